@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include "engine/sand.h"
+
+// Benchmark suite, see 'make bench'. Runs scripted scenarios with fixed seeds at a few world sizes and
+// reports throughput, rule evaluations, match rate and step latency as JSON, one result per line. Given a
+// baseline, an earlier output, it compares against it and fails on slowdowns past the tolerance, or on a
+// scenario that ends in a different world than it did
+
+#define N_SIZES 3
+#define MAX_RESULTS 64
+
+static const int sizes[N_SIZES] = {128, 256, 512};
+static const int steps_at[N_SIZES] = {1000, 400, 200}; // Steps at each size, fewer as the world grows
+
+// The rulesets, sorted so the scenarios play out the same whatever order the file system lists them in
+static char* rule_files[64];
+static int n_rule_files;
+
+static int compareNames(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static bool listRules(const char* directory) {
+	DIR* dir = opendir(directory);
+	if(dir == NULL)
+		return false;
+	struct dirent* ent;
+	while((ent = readdir(dir)) != NULL && n_rule_files < 64) {
+		if(ent->d_name[0] == '.')
+			continue;
+		rule_files[n_rule_files] = (char*)malloc(strlen(directory) + strlen(ent->d_name) + 2);
+		sprintf(rule_files[n_rule_files++], "%s/%s", directory, ent->d_name);
+	}
+	closedir(dir);
+	qsort(rule_files, n_rule_files, sizeof(char*), compareNames);
+	return n_rule_files > 0;
+}
+
+// splitmix64, like sand-headless' fills
+static uint64_t scatter_state;
+static double scatterRandom() {
+	uint64_t z = (scatter_state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return ((z ^ (z >> 31)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void fillColor(struct sand_world* world, uint32_t color, int left, int top, int right, int bottom, double percent) {
+	for(int j = top; j < bottom; j++)
+		for(int i = left; i < right; i++)
+			if(percent >= 100 || scatterRandom()*100 < percent)
+				sandPut(world, color, i, j);
+}
+
+// The element bound to 'key'. A scenario missing one would run on something else than it says, so it stops
+// the bench
+static void fill(struct sand_world* world, char key, int left, int top, int right, int bottom, double percent) {
+	uint32_t color = sandBind(world, key);
+	if(color == 0) {
+		printf("\033[0;31mNo element is bound to '%c', the rules aren't the ones the scenarios are for\033[0m\n", key);
+		exit(1);
+	}
+	fillColor(world, color, left, top, right, bottom, percent);
+}
+
+// A tall block of sand in the middle, collapsing into a pile
+static void sandPileSetup(struct sand_world* world, int w, int h) {
+	fill(world, 's', w/3, 0, 2*w/3, 2*h/3, 100);
+}
+
+// A stone basin, filled from a stream of water poured into its middle
+static void waterBasinSetup(struct sand_world* world, int w, int h) {
+	fill(world, 'x', w/8, h - h/16, w - w/8, h, 100);
+	fill(world, 'x', w/8, h/3, w/8 + 3, h, 100);
+	fill(world, 'x', w - w/8 - 3, h/3, w - w/8, h, 100);
+}
+
+static void waterBasinStep(struct sand_world* world, int w, int h, int step, int steps) {
+	fill(world, 'w', w/2 - w/32, 0, w/2 + w/32, 2, 100);
+}
+
+// A forest of grown reeds on a sand bank with seeds between them, set on fire from the left a third of the
+// way in. Reeds grow too slowly to wait for, they're planted grown
+#define REED SAND_COL(0x1e, 0xd0, 0x3c)
+static void reedFireSetup(struct sand_world* world, int w, int h) {
+	fill(world, 's', 0, h - h/8, w, h, 100);
+	fill(world, '1', 0, h - h/8 - 1, w, h - h/8, 30);
+	for(int i = 0; i < w; i++)
+		if(scatterRandom() < 0.6)
+			for(int j = h - h/8 - 1 - (int)(scatterRandom()*h/2); j < h - h/8; j++)
+				sandPut(world, REED, i, j);
+}
+
+static void reedFireStep(struct sand_world* world, int w, int h, int step, int steps) {
+	if(step == steps/3)
+		fill(world, 'f', 0, h/2, 2, h - h/8, 100);
+}
+
+// Rain and dry clouds drifting over a lake. Clouds have no key, they're placed by color
+#define DRY_CLOUD SAND_COL(0xe9, 0xec, 0xf2)
+#define RAIN_CLOUD SAND_COL(0x80, 0x82, 0x96)
+static void rainLakeSetup(struct sand_world* world, int w, int h) {
+	fill(world, 'd', 0, h - h/16, w, h, 100);
+	fill(world, 'w', 0, h - h/3, w, h - h/16, 100);
+	fillColor(world, DRY_CLOUD, 0, 0, w, h/10, 30);
+	fillColor(world, RAIN_CLOUD, 0, 0, w, h/10, 20);
+}
+
+struct scenario {
+	const char* name;
+	void (*setup)(struct sand_world* world, int w, int h);
+	// Scripted events before each step, if any
+	void (*step)(struct sand_world* world, int w, int h, int step, int steps);
+};
+
+static const struct scenario scenarios[] = {
+	{"sand_pile", sandPileSetup, NULL},
+	{"water_basin", waterBasinSetup, waterBasinStep},
+	{"reed_fire", reedFireSetup, reedFireStep},
+	{"rain_lake", rainLakeSetup, NULL},
+};
+#define N_SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+struct result {
+	char scenario[32];
+	int width, height, steps;
+	double seconds;
+	double cells_per_s, evaluations_per_s, match_rate;
+	double p50_ms, p90_ms, p99_ms, max_ms;
+	unsigned long long checksum;
+};
+
+static int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int n, double p) {
+	int i = (int)(p / 100 * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+static void run(const struct scenario* scenario, int threads, int size, int steps, struct result* result) {
+	struct sand_world* world = sandCreateWorld(size, size);
+	sandSeed(world, 1);
+	sandSetThreads(world, threads);
+	for(int f = 0; f < n_rule_files; f++)
+		sandLoadRule(world, rule_files[f]);
+	scatter_state = 1;
+	scenario->setup(world, size, size);
+
+	double* latencies = (double*)malloc(sizeof(double)*steps);
+	double start = now();
+	for(int s = 0; s < steps; s++) {
+		if(scenario->step != NULL)
+			scenario->step(world, size, size, s, steps);
+		double before = now();
+		sandStep(world, 1);
+		latencies[s] = now() - before;
+	}
+	double seconds = now() - start;
+	uint64_t evaluations, matches;
+	sandCounts(world, &evaluations, &matches);
+
+	qsort(latencies, steps, sizeof(double), compareDoubles);
+	snprintf(result->scenario, sizeof(result->scenario), "%s", scenario->name);
+	result->width = result->height = size;
+	result->steps = steps;
+	result->seconds = seconds;
+	result->cells_per_s = (double)size*size*steps / seconds;
+	result->evaluations_per_s = evaluations / seconds;
+	result->match_rate = evaluations > 0 ? (double)matches / evaluations : 0;
+	result->p50_ms = percentile(latencies, steps, 50) * 1e3;
+	result->p90_ms = percentile(latencies, steps, 90) * 1e3;
+	result->p99_ms = percentile(latencies, steps, 99) * 1e3;
+	result->max_ms = latencies[steps - 1] * 1e3;
+	uint64_t checksum = 14695981039346656037ull;
+	for(int j = 0; j < size; j++)
+		for(int i = 0; i < size; i++)
+			checksum = (checksum ^ sandGet(world, i, j)) * 1099511628211ull;
+	result->checksum = checksum;
+	free(latencies);
+	sandDestroyWorld(world);
+}
+
+static void writeResult(FILE* f, const struct result* r, bool last) {
+	fprintf(f, "  {\"scenario\": \"%s\", \"width\": %d, \"height\": %d, \"steps\": %d, \"seconds\": %.4f, "
+		"\"cells_per_s\": %.0f, \"evaluations_per_s\": %.0f, \"match_rate\": %.5f, "
+		"\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"checksum\": \"%016llx\"}%s\n",
+		r->scenario, r->width, r->height, r->steps, r->seconds, r->cells_per_s, r->evaluations_per_s, r->match_rate,
+		r->p50_ms, r->p90_ms, r->p99_ms, r->max_ms, r->checksum, last ? "" : ",");
+}
+
+// Reads back what writeResult wrote, a result per line
+static int readResults(const char* path, struct result* results) {
+	FILE* f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	char line[1024];
+	int n = 0;
+	while(n < MAX_RESULTS && fgets(line, sizeof(line), f) != NULL) {
+		struct result* r = results + n;
+		if(sscanf(line, " {\"scenario\": \"%31[^\"]\", \"width\": %d, \"height\": %d, \"steps\": %d, \"seconds\": %lf, "
+			"\"cells_per_s\": %lf, \"evaluations_per_s\": %lf, \"match_rate\": %lf, "
+			"\"p50_ms\": %lf, \"p90_ms\": %lf, \"p99_ms\": %lf, \"max_ms\": %lf, \"checksum\": \"%llx\"",
+			r->scenario, &r->width, &r->height, &r->steps, &r->seconds, &r->cells_per_s, &r->evaluations_per_s, &r->match_rate,
+			&r->p50_ms, &r->p90_ms, &r->p99_ms, &r->max_ms, &r->checksum) == 13)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static void usage(const char* name) {
+	printf("usage: %s [-r rules_dir] [-t threads] [-n repeats] [-o results.json] [-b baseline.json] [-x tolerance_percent]\n", name);
+	printf("  Each scenario runs 'repeats' times (5 by default) at each size and the fastest run is kept.\n");
+	printf("  With -b, fails if a scenario is slower than the baseline by more than the tolerance (10%% by\n");
+	printf("  default), or ends in a different world.\n");
+}
+
+int main(int argc, char* argv[]) {
+	const char* rules_dir = "./rules";
+	const char* output = NULL;
+	const char* baseline_path = NULL;
+	int threads = 1, repeats = 5;
+	double tolerance = 10;
+	for(int i = 1; i < argc; i++) {
+		if(i + 1 < argc && strcmp(argv[i], "-r") == 0)
+			rules_dir = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-t") == 0)
+			threads = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			repeats = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-o") == 0)
+			output = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-b") == 0)
+			baseline_path = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-x") == 0)
+			tolerance = atof(argv[++i]);
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(repeats < 1 || threads < 1 || tolerance < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(!listRules(rules_dir)) {
+		printf("No rules could be loaded from \"%s\"\n", rules_dir);
+		return 1;
+	}
+
+	struct result results[MAX_RESULTS];
+	int n_results = 0;
+	for(int s = 0; s < N_SCENARIOS; s++)
+		for(int z = 0; z < N_SIZES; z++) {
+			struct result best;
+			for(int r = 0; r < repeats; r++) {
+				struct result result;
+				run(scenarios + s, threads, sizes[z], steps_at[z], &result);
+				if(r == 0 || result.seconds < best.seconds)
+					best = result;
+			}
+			results[n_results++] = best;
+			printf("%-12s %4dx%-4d %10.3f Mcells/s %10.3f Mevals/s  match %6.2f%%  p50 %7.3fms  p99 %7.3fms\n", best.scenario,
+				best.width, best.height, best.cells_per_s / 1e6, best.evaluations_per_s / 1e6, best.match_rate * 100, best.p50_ms, best.p99_ms);
+		}
+
+	if(output != NULL) {
+		FILE* f = fopen(output, "w");
+		if(f == NULL) {
+			printf("\033[0;31mCouldn't open \"%s\" for writing\033[0m\n", output);
+			return 1;
+		}
+		fprintf(f, "{\"threads\": %d, \"repeats\": %d, \"results\": [\n", threads, repeats);
+		for(int r = 0; r < n_results; r++)
+			writeResult(f, results + r, r == n_results - 1);
+		fprintf(f, "]}\n");
+		fclose(f);
+	}
+
+	if(baseline_path == NULL)
+		return 0;
+	struct result baseline[MAX_RESULTS];
+	int n_baseline = readResults(baseline_path, baseline);
+	if(n_baseline < 0) {
+		printf("\033[0;31mNo baseline at \"%s\" to compare with, 'make bench-baseline' saves one\033[0m\n", baseline_path);
+		return 1;
+	}
+	int failed = 0;
+	printf("\nAgainst \"%s\":\n", baseline_path);
+	for(int r = 0; r < n_results; r++) {
+		const struct result* result = results + r;
+		const struct result* previous = NULL;
+		for(int b = 0; b < n_baseline; b++)
+			if(strcmp(baseline[b].scenario, result->scenario) == 0 && baseline[b].width == result->width && baseline[b].height == result->height && baseline[b].steps == result->steps)
+				previous = baseline + b;
+		if(previous == NULL) {
+			printf("%-12s %4dx%-4d not in the baseline\n", result->scenario, result->width, result->height);
+			continue;
+		}
+		double change = (result->cells_per_s / previous->cells_per_s - 1) * 100;
+		bool slower = change < -tolerance, different = result->checksum != previous->checksum;
+		printf("%s%-12s %4dx%-4d %+7.1f%% cells/s  p99 %7.3fms -> %7.3fms%s\033[0m\n", slower || different ? "\033[0;31m" : "",
+			result->scenario, result->width, result->height, change, previous->p99_ms, result->p99_ms, different ? "  ends in a different world" : "");
+		failed += slower || different;
+	}
+	if(failed > 0)
+		printf("\033[0;31m%d of %d results are slower than %.0f%% or changed\033[0m\n", failed, n_results, tolerance);
+	return failed > 0 ? 1 : 0;
+}
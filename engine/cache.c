@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "internal.h"
+
+// Cache of resolved rules, see sandLoadRulesCached. Loading a ruleset directory into an empty world
+// always gives the same elements, identities and rules, mirrors included, so those are written out once
+// and mapped back in on later starts. The file is keyed by a hash of the ruleset files' names and
+// contents in load order, and carries a hash of its own contents. Everything in it is checked before any
+// of it reaches the world, a cache that doesn't add up is parsed around and rewritten.
+//
+// Layout, in the host's byte order: the header, masks[n_elements], colors[n_elements], binds[256], the
+// identities, the rules, then every identity's members and every identity's name, each ending in a 0
+
+#define CACHE_MAGIC 0x53454c5552444e53ull // "SNDRULES"
+#define CACHE_VERSION 2
+
+struct cache_header {
+	uint64_t magic;
+	uint64_t key;
+	uint64_t sum; // Hash of everything after the header
+	uint32_t version;
+	uint32_t n_elements;
+	uint32_t n_identities;
+	uint32_t n_rules;
+	uint32_t n_members; // Of all identities together
+	uint32_t names_size;
+};
+
+struct cache_identity {
+	uint32_t member_count;
+	uint32_t name; // Offset into the names
+};
+
+struct cache_cell {
+	int8_t match_type, replace_type;
+	int8_t refX, refY;
+	uint32_t match_value, replace_value;
+};
+
+struct cache_rule {
+	struct cache_cell cells[25]; // j*5+i
+	float chance;
+	uint32_t mirror; // 1 if it's a mirror of the rule before it, sharing its search_for
+	char origin[40];
+};
+
+struct cache_layout {
+	struct cache_header* header;
+	uint64_t* masks;
+	uint32_t* colors;
+	uint32_t* binds;
+	struct cache_identity* identities;
+	struct cache_rule* rules;
+	uint16_t* members;
+	char* names;
+};
+
+// Size of a cache with the given counts, and where everything is in it if 'base' isn't NULL. The counts
+// are bounded, so this can't overflow
+static size_t layoutCache(uint8_t* base, const struct cache_header* counts, struct cache_layout* layout) {
+	size_t masks = sizeof(struct cache_header);
+	size_t colors = masks + sizeof(uint64_t)*counts->n_elements;
+	size_t binds = colors + sizeof(uint32_t)*counts->n_elements;
+	size_t identities = binds + sizeof(uint32_t)*256;
+	size_t rules = identities + sizeof(struct cache_identity)*counts->n_identities;
+	size_t members = rules + sizeof(struct cache_rule)*counts->n_rules;
+	size_t names = members + sizeof(uint16_t)*counts->n_members;
+	size_t size = names + counts->names_size;
+	if(base != NULL) {
+		layout->header = (struct cache_header*)base;
+		layout->masks = (uint64_t*)(base + masks);
+		layout->colors = (uint32_t*)(base + colors);
+		layout->binds = (uint32_t*)(base + binds);
+		layout->identities = (struct cache_identity*)(base + identities);
+		layout->rules = (struct cache_rule*)(base + rules);
+		layout->members = (uint16_t*)(base + members);
+		layout->names = (char*)(base + names);
+	}
+	return size;
+}
+
+uint64_t cacheKey(const struct rule_file* files, int n_files) {
+	uint64_t hash = HASH_START;
+	uint32_t version = CACHE_VERSION;
+	hash = hashBytes(hash, &version, sizeof(version));
+	for(int f = 0; f < n_files; f++) {
+		uint64_t size = files[f].size;
+		hash = hashBytes(hash, files[f].name, strlen(files[f].name) + 1);
+		hash = hashBytes(hash, &size, sizeof(size));
+		hash = hashBytes(hash, files[f].text, files[f].size);
+	}
+	return hash;
+}
+
+// Maps a whole file read only, or reads it where there's no mmap
+const uint8_t* mapFile(const char* path, size_t* size) {
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	struct stat st;
+	void* data = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return (const uint8_t*)data;
+#else
+	// No mmap, read it whole
+	FILE* f = fopen(path, "rb");
+	if(f == NULL)
+		return NULL;
+	uint8_t* data = NULL;
+	long length;
+	if(fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+		data = (uint8_t*)malloc(length);
+		if(fread(data, 1, length, f) != (size_t)length) {
+			free(data);
+			data = NULL;
+		}
+		*size = length;
+	}
+	fclose(f);
+	return data;
+#endif
+}
+
+void unmapFile(const uint8_t* data, size_t size) {
+#ifndef _WIN32
+	munmap((void*)data, size);
+#else
+	free((void*)data);
+#endif
+}
+
+// Files are written next to the one they replace and moved over it once whole, so a reader never sees
+// one half written. Opens the new file, 'temporary' is its path for replaceFile. May return NULL
+FILE* createReplacement(const char* path, char** temporary) {
+	*temporary = (char*)malloc(strlen(path) + 5);
+	strcpy(*temporary, path);
+	strcat(*temporary, ".new");
+	return fopen(*temporary, "wb");
+}
+
+// Closes the new file and moves it over 'path' if it was 'written' whole, otherwise removes it and says
+// which 'what' couldn't be written. Returns whether 'path' was replaced
+bool replaceFile(FILE* f, char* temporary, const char* path, bool written, const char* what) {
+	if(f != NULL)
+		written = fclose(f) == 0 && written;
+	else
+		written = false;
+#ifdef _WIN32
+	// rename() doesn't replace files here
+	if(written)
+		remove(path);
+#endif
+	if(!written || rename(temporary, path) != 0) {
+		printf("\033[0;31mCouldn't write the %s \"%s\"\033[0m\n", what, path);
+		remove(temporary);
+		written = false;
+	}
+	free(temporary);
+	return written;
+}
+
+static int compareColors(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static bool checkCell(const struct cache_cell* cell, const struct cache_header* header) {
+	if(cell->match_type < -1 || cell->match_type > 1 || cell->replace_type < -1 || cell->replace_type > 3)
+		return false;
+	if((cell->match_type == 0 && cell->match_value >= header->n_elements) || (cell->match_type == 1 && cell->match_value >= header->n_identities))
+		return false;
+	return (cell->replace_type != 0 || cell->replace_value < header->n_elements) && (cell->replace_type != 3 || cell->replace_value < header->n_identities);
+}
+
+// Whether the cache at 'data' is for 'key' and holds up, with every index in range
+static bool checkCache(const uint8_t* data, size_t size, uint64_t key, struct cache_layout* layout) {
+	if(size < sizeof(struct cache_header))
+		return false;
+	const struct cache_header* header = (const struct cache_header*)data;
+	if(header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->key != key)
+		return false;
+	if(header->n_elements < 1 || header->n_elements > MAX_ELEMENTS || header->n_identities > MAX_IDENTITIES || header->n_rules > MAX_RULES
+		|| header->n_members > (uint64_t)header->n_identities*header->n_elements || header->names_size > size)
+		return false;
+	if(layoutCache(NULL, header, layout) != size || hashBytes(HASH_START, data + sizeof(struct cache_header), size - sizeof(struct cache_header)) != header->sum)
+		return false;
+	layoutCache((uint8_t*)data, header, layout);
+	if(layout->colors[0] != AIR)
+		return false;
+
+	// Colors must be distinct to intern to the same IDs
+	uint32_t* sorted = (uint32_t*)malloc(sizeof(uint32_t)*header->n_elements);
+	memcpy(sorted, layout->colors, sizeof(uint32_t)*header->n_elements);
+	qsort(sorted, header->n_elements, sizeof(uint32_t), compareColors);
+	bool distinct = true;
+	for(uint32_t e = 1; e < header->n_elements; e++)
+		distinct &= sorted[e] != sorted[e-1];
+	free(sorted);
+	if(!distinct)
+		return false;
+
+	uint64_t identity_bits = header->n_identities == 64 ? ~(uint64_t)0 : ((uint64_t)1 << header->n_identities) - 1;
+	for(uint32_t e = 0; e < header->n_elements; e++)
+		if(layout->masks[e] & ~identity_bits)
+			return false;
+	uint64_t members = 0;
+	for(uint32_t i = 0; i < header->n_identities; i++) {
+		members += layout->identities[i].member_count;
+		if(layout->identities[i].name >= header->names_size)
+			return false;
+	}
+	if(members != header->n_members || (header->names_size > 0 && layout->names[header->names_size - 1] != '\0'))
+		return false;
+	for(uint32_t m = 0; m < header->n_members; m++)
+		if(layout->members[m] >= header->n_elements)
+			return false;
+	for(uint32_t r = 0; r < header->n_rules; r++) {
+		if(layout->rules[r].mirror > 1 || (r == 0 && layout->rules[r].mirror))
+			return false;
+		for(int c = 0; c < 25; c++)
+			if(!checkCell(layout->rules[r].cells + c, header))
+				return false;
+	}
+	return true;
+}
+
+// Loads the cached rules into an empty world, returns false and leaves the world alone if the cache
+// at 'path' is missing, out of date or broken
+bool loadCache(struct sand_world* world, const char* path, uint64_t key) {
+	size_t size;
+	const uint8_t* data = mapFile(path, &size);
+	if(data == NULL)
+		return false;
+	struct cache_layout layout;
+	if(!checkCache(data, size, key, &layout)) {
+		unmapFile(data, size);
+		return false;
+	}
+	const struct cache_header* header = layout.header;
+
+	for(uint32_t e = 1; e < header->n_elements; e++)
+		intern(world, layout.colors[e]);
+	memcpy(world->masks, layout.masks, sizeof(uint64_t)*header->n_elements);
+	memcpy(world->binds, layout.binds, sizeof(world->binds));
+
+	world->identities = (struct identity*)realloc(world->identities, sizeof(struct identity)*(header->n_identities ? header->n_identities : 1));
+	const uint16_t* members = layout.members;
+	for(uint32_t i = 0; i < header->n_identities; i++) {
+		struct identity* id = world->identities + i;
+		const char* name = layout.names + layout.identities[i].name;
+		char* copy = (char*)malloc(strlen(name) + 1);
+		strcpy(copy, name);
+		id->name = copy;
+		id->member_count = layout.identities[i].member_count;
+		id->members = NULL;
+		if(id->member_count > 0) {
+			id->members = (uint16_t*)malloc(sizeof(uint16_t)*id->member_count);
+			memcpy(id->members, members, sizeof(uint16_t)*id->member_count);
+			members += id->member_count;
+		}
+	}
+	world->n_identities = header->n_identities;
+
+	for(uint32_t r = 0; r < header->n_rules; r++) {
+		const struct cache_rule* cached = layout.rules + r;
+		struct rule rule;
+		memset(&rule, 0, sizeof(struct rule));
+		rule.chance = cached->chance;
+		for(int c = 0; c < 25; c++) {
+			const struct cache_cell* cell = cached->cells + c;
+			rule.match[c/5][c%5].type = cell->match_type;
+			rule.match[c/5][c%5].value = cell->match_value;
+			rule.replace[c/5][c%5].type = cell->replace_type;
+			rule.replace[c/5][c%5].refX = cell->refX;
+			rule.replace[c/5][c%5].refY = cell->refY;
+			rule.replace[c/5][c%5].value = cell->replace_value;
+		}
+		memcpy(rule.origin, cached->origin, sizeof(rule.origin));
+		rule.origin[sizeof(rule.origin) - 1] = '\0';
+		finishRule(&rule, cached->mirror ? world->rules + r - 1 : NULL);
+		world->rules[r] = rule;
+	}
+	world->n_rules = header->n_rules;
+	unmapFile(data, size);
+	return true;
+}
+
+// Writes the world's rules to 'path' for loadCache. The world must hold nothing but what was loaded
+// from the ruleset files 'key' was made from
+void writeCache(struct sand_world* world, const char* path, uint64_t key) {
+	struct cache_header header = {CACHE_MAGIC, key, 0, CACHE_VERSION, world->n_elements, world->n_identities, world->n_rules, 0, 0};
+	for(int i = 0; i < world->n_identities; i++) {
+		header.n_members += world->identities[i].member_count;
+		header.names_size += strlen(world->identities[i].name) + 1;
+	}
+	struct cache_layout layout;
+	size_t size = layoutCache(NULL, &header, &layout);
+	uint8_t* data = (uint8_t*)calloc(1, size);
+	layoutCache(data, &header, &layout);
+
+	*layout.header = header;
+	memcpy(layout.masks, world->masks, sizeof(uint64_t)*world->n_elements);
+	memcpy(layout.colors, world->colors, sizeof(uint32_t)*world->n_elements);
+	memcpy(layout.binds, world->binds, sizeof(world->binds));
+	uint16_t* members = layout.members;
+	char* names = layout.names;
+	for(int i = 0; i < world->n_identities; i++) {
+		const struct identity* id = world->identities + i;
+		layout.identities[i].member_count = id->member_count;
+		layout.identities[i].name = names - layout.names;
+		memcpy(members, id->members, sizeof(uint16_t)*id->member_count);
+		members += id->member_count;
+		strcpy(names, id->name);
+		names += strlen(id->name) + 1;
+	}
+	for(int r = 0; r < world->n_rules; r++) {
+		const struct rule* rule = world->rules + r;
+		struct cache_rule* cached = layout.rules + r;
+		cached->chance = rule->chance;
+		cached->mirror = r > 0 && rule->search_for == world->rules[r-1].search_for;
+		memcpy(cached->origin, rule->origin, sizeof(cached->origin));
+		for(int c = 0; c < 25; c++) {
+			const struct match_t* match = &rule->match[c/5][c%5];
+			const struct replace_t* replace = &rule->replace[c/5][c%5];
+			struct cache_cell* cell = cached->cells + c;
+			cell->match_type = match->type;
+			cell->match_value = match->type == -1 ? 0 : match->value;
+			cell->replace_type = replace->type;
+			cell->refX = replace->type == 1 || replace->type == 2 ? replace->refX : 0;
+			cell->refY = replace->type == 1 || replace->type == 2 ? replace->refY : 0;
+			cell->replace_value = replace->type == -1 || replace->type == 1 ? 0 : replace->value;
+		}
+	}
+
+	layout.header->sum = hashBytes(HASH_START, data + sizeof(struct cache_header), size - sizeof(struct cache_header));
+
+	char* temporary;
+	FILE* f = createReplacement(path, &temporary);
+	replaceFile(f, temporary, path, f != NULL && fwrite(data, 1, size, f) == size, "rules cache");
+	free(data);
+}
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// The world is split into CHUNK_SIZE x CHUNK_SIZE chunks. Each chunk counts its elements and identities
+// for potential(), and tracks whether it or a neighbor changed recently. Chunks that stay quiet for
+// sleep_after iterations, and in which no rule fits anywhere, go to sleep and are skipped by the sweep
+// until a write next to or inside them wakes them up. Awake chunks are kept in lists, nothing here
+// walks every chunk or every cell of the world once it has settled.
+
+// Region writers: put() moves one cell's count from its old element to the new one. Chunks swept in
+// parallel can both write into the chunk between them, so writers take the region's spinlock. Readers
+// don't lock, they retry if a writer was busy with the region meanwhile.
+
+static void lockRegion(struct region* r) {
+	while(__atomic_test_and_set(&r->lock, __ATOMIC_ACQUIRE))
+		;
+	__atomic_store_n(&r->version, r->version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void unlockRegion(struct region* r) {
+	__atomic_store_n(&r->version, r->version + 1, __ATOMIC_RELEASE);
+	__atomic_clear(&r->lock, __ATOMIC_RELEASE);
+}
+
+static void setEntry(struct region* r, int e, uint32_t entry) {
+	__atomic_store_n(&r->entries[e], entry, __ATOMIC_RELAXED);
+}
+
+static void countIdentities(struct region* r, uint64_t mask, int delta) {
+	uint64_t identities = r->identities;
+	for(; mask; mask &= mask - 1) {
+		int i = __builtin_ctzll(mask);
+		r->identity_counts[i] += delta;
+		if(r->identity_counts[i] == 0)
+			identities &= ~((uint64_t)1 << i);
+		else
+			identities |= (uint64_t)1 << i;
+	}
+	__atomic_store_n(&r->identities, identities, __ATOMIC_RELAXED);
+}
+
+// Add 'delta' cells of 'element', the region must be locked. Elements that find no free entry are
+// counted in 'overflow', so the count of an element in 'entries' may fall short of its real count,
+// by at most 'overflow'. Once overflow is back to 0 every element is counted exactly again
+static void countElement(struct sand_world* world, struct region* r, uint16_t element, int delta) {
+	int free_entry = -1;
+	for(int e = 0; e < REGION_ENTRIES; e++) {
+		uint32_t entry = r->entries[e];
+		if(entry == 0) {
+			if(free_entry == -1)
+				free_entry = e;
+		} else if(entry >> 16 == element) {
+			if(delta > 0 || (entry & 0xffff) >= -delta) {
+				uint32_t count = (entry & 0xffff) + delta;
+				setEntry(r, e, count == 0 ? 0 : (uint32_t)element << 16 | count);
+				delta = 0;
+			}
+			break;
+		}
+	}
+	if(delta > 0 && free_entry != -1)
+		setEntry(r, free_entry, (uint32_t)element << 16 | delta);
+	else if(delta != 0)
+		__atomic_store_n(&r->overflow, r->overflow + delta, __ATOMIC_RELAXED);
+}
+
+void regionMove(struct sand_world* world, struct region* r, uint16_t from, uint16_t to) {
+	lockRegion(r);
+	countElement(world, r, from, -1);
+	countElement(world, r, to, 1);
+	countIdentities(r, world->masks[from], -1);
+	countIdentities(r, world->masks[to], 1);
+	unlockRegion(r);
+}
+
+static bool regionHasElement(struct region* r, uint16_t element) {
+	for(;;) {
+		uint32_t version = __atomic_load_n(&r->version, __ATOMIC_ACQUIRE);
+		bool found = false;
+		if(version % 2 == 0) {
+			found = __atomic_load_n(&r->overflow, __ATOMIC_RELAXED) > 0;
+			for(int e = 0; e < REGION_ENTRIES && !found; e++) {
+				uint32_t entry = __atomic_load_n(&r->entries[e], __ATOMIC_RELAXED);
+				found = entry != 0 && entry >> 16 == element;
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&r->version, __ATOMIC_RELAXED) == version)
+				return found;
+		}
+	}
+}
+
+bool regionHas(struct sand_world* world, struct region *r, struct match_t t) {
+	if(r == NULL)
+		return false;
+	if(t.type==-1)
+		return true;
+	if(t.type==0)
+		return regionHasElement(r, t.value);
+	return (__atomic_load_n(&r->identities, __ATOMIC_RELAXED) >> t.value) & 1;
+}
+
+void createChunks(struct sand_world* world) {
+	world->chunks_x = (world->width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	world->chunks_y = (world->height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	int n_chunks = world->chunks_x*world->chunks_y;
+	world->chunks = (struct chunk*)calloc(n_chunks, sizeof(struct chunk));
+	world->awake = (int*)malloc(sizeof(int)*n_chunks);
+	world->woken = (int*)malloc(sizeof(int)*n_chunks);
+	world->n_awake = world->n_woken = 0;
+	for(int c = 0; c < n_chunks; c++)
+		world->chunks[c].quiet = UINT16_MAX; // An empty world has nothing to simulate, so the chunks start asleep
+	rebuildRegions(world); // We always start with AIR everywhere
+}
+
+void destroyChunks(struct sand_world* world) {
+	free(world->chunks);
+	free(world->awake);
+	free(world->woken);
+}
+
+// Sweep positions whose window is centered in the chunk. The outer chunks also own the positions
+// whose center lies outside the world. The range may be empty
+void chunkPositions(struct sand_world* world, int cx, int cy, int* left, int* right, int* top, int* bottom) {
+	*left = cx == 0 ? -4 : cx*CHUNK_SIZE - 2;
+	*right = cx == world->chunks_x - 1 ? world->width + 4 : (cx+1)*CHUNK_SIZE - 3;
+	*top = cy == 0 ? -4 : cy*CHUNK_SIZE - 2;
+	*bottom = cy == world->chunks_y - 1 ? world->height + 4 : (cy+1)*CHUNK_SIZE - 3;
+	// No rule fits at the positions outside of sweep_*, see compileRules
+	*left = *left < world->sweep_left ? world->sweep_left : *left;
+	*right = *right > world->sweep_right ? world->sweep_right : *right;
+	*top = *top < world->sweep_top ? world->sweep_top : *top;
+	*bottom = *bottom > world->sweep_bottom ? world->sweep_bottom : *bottom;
+}
+
+// Chunk that owns the sweep position (x, y), that is the chunk of the center of the rule's 5x5 window
+struct chunk* positionChunk(struct sand_world* world, int x, int y) {
+	int cx = (x + 2) < 0 ? 0 : (x + 2) / CHUNK_SIZE, cy = (y + 2) < 0 ? 0 : (y + 2) / CHUNK_SIZE;
+	if(cx >= world->chunks_x)
+		cx = world->chunks_x - 1;
+	if(cy >= world->chunks_y)
+		cy = world->chunks_y - 1;
+	return world->chunks + cx + cy*world->chunks_x;
+}
+
+// Reset the chunk's quiet count and add it to the woken list if it isn't listed yet. Called from the
+// sweep threads, so the list is appended to atomically
+static void wake(struct sand_world* world, int c) {
+	struct chunk* chunk = world->chunks + c;
+	if(__atomic_load_n(&chunk->quiet, __ATOMIC_RELAXED) != 0)
+		__atomic_store_n(&chunk->quiet, 0, __ATOMIC_RELAXED);
+	if(!__atomic_load_n(&chunk->listed, __ATOMIC_RELAXED) && !__atomic_exchange_n(&chunk->listed, true, __ATOMIC_RELAXED))
+		world->woken[__atomic_fetch_add(&world->n_woken, 1, __ATOMIC_RELAXED)] = c;
+}
+
+// Mark the cell (x, y) as written. The first write to a chunk in an iteration wakes it and its neighbors,
+// since their rule windows reach into it. Chunks swept in parallel can both write into the chunk between
+// them, so the flags are set atomically
+void touch(struct sand_world* world, int x, int y) {
+	int cx = x / CHUNK_SIZE, cy = y / CHUNK_SIZE;
+	struct chunk* chunk = world->chunks + cx + cy*world->chunks_x;
+	if(__atomic_load_n(&chunk->changed, __ATOMIC_RELAXED))
+		return;
+	__atomic_store_n(&chunk->changed, true, __ATOMIC_RELAXED);
+	for(int j = cy - 1; j <= cy + 1; j++)
+		for(int i = cx - 1; i <= cx + 1; i++)
+			if(i >= 0 && i < world->chunks_x && j >= 0 && j < world->chunks_y)
+				wake(world, i + j*world->chunks_x);
+}
+
+void wakeAll(struct sand_world* world) {
+	for(int c = 0; c < world->chunks_x*world->chunks_y; c++)
+		wake(world, c);
+	if(world->worklist != NULL)
+		worklistEverything(world);
+}
+
+// Move the woken chunks over to the awake list
+static void mergeWoken(struct sand_world* world) {
+	for(int w = 0; w < world->n_woken; w++)
+		world->awake[world->n_awake++] = world->woken[w];
+	world->n_woken = 0;
+}
+
+// Recount every region from scratch. Only needed when the identity masks change, that is when rules load
+void rebuildRegions(struct sand_world* world) {
+	for(int cy = 0; cy < world->chunks_y; cy++)
+		for(int cx = 0; cx < world->chunks_x; cx++) {
+			struct region* region = &world->chunks[cx + cy*world->chunks_x].region;
+			memset(region, 0, sizeof(struct region));
+			lockRegion(region);
+			for(int j = cy*CHUNK_SIZE; j < (cy+1)*CHUNK_SIZE && j < world->height; j++)
+				for(int i = cx*CHUNK_SIZE; i < (cx+1)*CHUNK_SIZE && i < world->width; i++) {
+					countElement(world, region, get(world, i, j), 1);
+					countIdentities(region, world->masks[get(world, i, j)], 1);
+				}
+			unlockRegion(region);
+		}
+}
+
+// Whether the chunk or one of its neighbors has the element or identity, the windows of the positions
+// a chunk owns stay within its neighbors
+static bool nearbyHas(struct sand_world* world, int cx, int cy, struct match_t t) {
+	for(int j = cy - 1; j <= cy + 1; j++)
+		for(int i = cx - 1; i <= cx + 1; i++)
+			if(i >= 0 && i < world->chunks_x && j >= 0 && j < world->chunks_y
+				&& regionHas(world, &world->chunks[i + j*world->chunks_x].region, t))
+				return true;
+	return false;
+}
+
+// Rules that might fit at one of the positions the chunk owns. Only the rules whose elements are all
+// around can fit, which usually rules out most of them
+int possibleRules(struct sand_world* world, int cx, int cy, int* possible) {
+	int left, right, top, bottom;
+	chunkPositions(world, cx, cy, &left, &right, &top, &bottom);
+	struct presence presence = presenceOf(world, left, top, right + 4, bottom + 4);
+	int n_possible = 0;
+	for(int r = 0; r < world->n_rules; r++) {
+		bool found = presenceCovers(presence, world->rules[r].needs);
+		for(int i = 0; i < world->rules[r].num_search_for && found; i++)
+			found = nearbyHas(world, cx, cy, world->rules[r].search_for[i]);
+		if(found)
+			possible[n_possible++] = r;
+	}
+	return n_possible;
+}
+
+// Whether any rule, ignoring its chance, fits at one of the positions the chunk owns
+static bool settled(struct sand_world* world, int cx, int cy) {
+	int left, right, top, bottom;
+	chunkPositions(world, cx, cy, &left, &right, &top, &bottom);
+	int possible[MAX_RULES];
+	int n_possible = possibleRules(world, cx, cy, possible);
+	if(n_possible == 0)
+		return true;
+
+	for(int y = top; y <= bottom; y++)
+		for(int p = 0; p < n_possible; p++)
+			if(fitsRow(world, world->rules + possible[p], left, y, right - left + 1, ~(uint64_t)0))
+				return false;
+	return true;
+}
+
+static void ageTask(void* context, int task, int worker) {
+	struct sand_world* world = (struct sand_world*)context;
+	int c = world->awake[task];
+	struct chunk* chunk = world->chunks + c;
+	chunk->quiet++;
+	if(chunk->quiet == world->sleep_after && !settled(world, c % world->chunks_x, c / world->chunks_x))
+		chunk->quiet = 0;
+}
+
+// Run at the end of every iteration: age the chunks and put the settled ones to sleep
+void updateChunks(struct sand_world* world) {
+	mergeWoken(world);
+	for(int a = 0; a < world->n_awake; a++)
+		if(world->chunks[world->awake[a]].changed) {
+			world->chunks[world->awake[a]].changed = false;
+			presenceChanged(world, world->awake[a]);
+			if(world->recording != NULL)
+				recordChanged(world, world->awake[a]);
+			if(world->view != NULL)
+				viewChanged(world, world->awake[a]);
+		}
+	rebuildPresence(world);
+	poolRun(world->pool, world->n_awake, ageTask, world);
+	if(world->worklist != NULL)
+		retireSettled(world);
+	int n = 0;
+	for(int a = 0; a < world->n_awake; a++) {
+		struct chunk* chunk = world->chunks + world->awake[a];
+		if(chunk->quiet >= world->sleep_after)
+			chunk->listed = false;
+		else
+			world->awake[n++] = world->awake[a];
+	}
+	world->n_awake = n;
+}
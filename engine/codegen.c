@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include "internal.h"
+
+// Ahead of time compiled rulesets. sandWriteCompiled turns the loaded rules into C, a straight-line fits
+// and enforce function per rule with the offsets, elements and identities as constants, and a table of
+// them named sand_compiled_rules. The generated file is built along with the engine (see 'make aot') and
+// attached with sandUseCompiled, after loading the same rules. The interpreter stays for everything else.
+//
+// Element IDs and identity indices depend on the order the rules were loaded in, so each generated rule
+// carries a fingerprint of the rule it was made from, and is only attached to a rule that matches it.
+
+// Hash of what the generated functions bake in. Only the fields each type uses, loadRule leaves the
+// others unset
+static uint64_t ruleFingerprint(const struct rule* rule) {
+	uint64_t hash = HASH_START;
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; i < 5; i++) {
+			const struct match_t* match = &rule->match[j][i];
+			const struct replace_t* replace = &rule->replace[j][i];
+			hash = hashBytes(hash, &match->type, sizeof(match->type));
+			if(match->type != -1)
+				hash = hashBytes(hash, &match->value, sizeof(match->value));
+			hash = hashBytes(hash, &replace->type, sizeof(replace->type));
+			if(replace->type == 1 || replace->type == 2) {
+				hash = hashBytes(hash, &replace->refX, sizeof(replace->refX));
+				hash = hashBytes(hash, &replace->refY, sizeof(replace->refY));
+			}
+			if(replace->type != -1 && replace->type != 1)
+				hash = hashBytes(hash, &replace->value, sizeof(replace->value));
+		}
+	hash = hashBytes(hash, &rule->needs, sizeof(rule->needs));
+	return hash;
+}
+
+static void writeFits(struct sand_world* world, FILE* f, int r) {
+	const struct rule* rule = world->rules + r;
+	fprintf(f, "static bool fits%d(struct sand_world* world, int x, int y) {\n", r);
+	if(rule->n_checks > 0)
+		fprintf(f, "\tif(x < %d || x >= world->width - %d || y < %d || y >= world->height - %d)\n\t\treturn false;\n",
+			-rule->footprint.left, rule->footprint.right, -rule->footprint.top, rule->footprint.bottom);
+	else
+		fprintf(f, "\tif(x >= world->width || x < -5 || y >= world->height || y < -5)\n\t\treturn false;\n");
+	fprintf(f, "\tif(!presenceCovers(tilePresence(world, x, y, x + 4, y + 4), (struct presence){0x%016llxull, 0x%016llxull}))\n\t\treturn false;\n",
+		(unsigned long long)rule->needs.identities, (unsigned long long)rule->needs.elements);
+	if(rule->n_checks == 0) {
+		fprintf(f, "\treturn true;\n}\n\n");
+		return;
+	}
+	fprintf(f, "\tconst uint16_t* c = world->cells + x + (ptrdiff_t)y * world->width;\n");
+	fprintf(f, "\tconst ptrdiff_t w = world->width;\n");
+	fprintf(f, "\treturn");
+	// In the order of the rule's program, most selective first
+	for(int k = 0; k < rule->n_checks; k++) {
+		int i = rule->program[k].cell % 5, j = rule->program[k].cell / 5;
+		fprintf(f, k == 0 ? " " : "\n\t\t&& ");
+		if(rule->program[k].type == 0)
+			fprintf(f, "c[%d + %d*w] == %u", i, j, rule->program[k].value);
+		else
+			fprintf(f, "((world->masks[c[%d + %d*w]] >> %u) & 1)", i, j, rule->program[k].value);
+	}
+	fprintf(f, ";\n}\n\n");
+}
+
+static void writeEnforce(struct sand_world* world, FILE* f, int r) {
+	const struct rule* rule = world->rules + r;
+	fprintf(f, "static void enforce%d(struct sand_world* world, int x, int y, struct rng* rng) {\n", r);
+	fprintf(f, "\t(void)rng;\n");
+	bool rows[5] = {false}, columns[5] = {false};
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; i < 5; i++)
+			if(rule->replace[j][i].type != -1)
+				rows[j] = columns[i] = true;
+	for(int j = 0; j < 5; j++)
+		if(rows[j])
+			fprintf(f, "\tbool row%d = y + %d >= 0 && y + %d < world->height;\n", j, j, j);
+	for(int i = 0; i < 5; i++)
+		if(columns[i])
+			fprintf(f, "\tbool column%d = x + %d >= 0 && x + %d < world->width;\n", i, i, i);
+
+	// Every new cell is worked out before any is written, like enforce()
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; i < 5; i++) {
+			const struct replace_t* replace = &rule->replace[j][i];
+			if(replace->type == -1)
+				continue;
+			fprintf(f, "\tuint16_t s%d%d = 0;\n", j, i);
+			fprintf(f, "\tif(row%d && column%d)\n\t\ts%d%d = ", j, i, j, i);
+			if(replace->type == 0)
+				fprintf(f, "%u;\n", replace->value);
+			else if(replace->type == 1)
+				fprintf(f, "get(world, x + %d, y + %d);\n", i + replace->refX, j + replace->refY);
+			else if(replace->type == 2)
+				fprintf(f, "edit(world, get(world, x + %d, y + %d), %d, %d, %d);\n", i + replace->refX, j + replace->refY,
+					(int8_t)((replace->value >> 16) & 0xff), (int8_t)((replace->value >> 8) & 0xff), (int8_t)(replace->value & 0xff));
+			else
+				fprintf(f, "member(world, %u, x + %d, y + %d, rng);\n", replace->value, i, j);
+		}
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; i < 5; i++)
+			if(rule->replace[j][i].type != -1)
+				fprintf(f, "\tif(row%d && column%d)\n\t\tput(world, s%d%d, x + %d, y + %d);\n", j, i, j, i, i, j);
+	fprintf(f, "}\n\n");
+}
+
+bool sandWriteCompiled(struct sand_world* world, const char* path) {
+	FILE* f = fopen(path, "w");
+	if(f == NULL) {
+		printf("\033[0;31mCouldn't open \"%s\" for writing\033[0m\n", path);
+		return false;
+	}
+	fprintf(f, "// Generated by sand-headless -g from %d rules, don't edit. See engine/codegen.c\n\n", world->n_rules);
+	fprintf(f, "#include <stddef.h>\n#include \"internal.h\"\n\n");
+	// The same arithmetic as enforce()'s edit replacements
+	fprintf(f, "static inline uint16_t edit(struct sand_world* world, uint16_t element, int red, int green, int blue) {\n");
+	fprintf(f, "\tuint32_t col = world->colors[element];\n");
+	fprintf(f, "\treturn intern(world, ((((col>>16)&0xff)+red) << 16) + ((((col>> 8)&0xff)+green) <<  8) + (col&0xff)+blue + (col&0xff000000));\n");
+	fprintf(f, "}\n\n");
+	fprintf(f, "static inline uint16_t member(struct sand_world* world, int identity, int x, int y, struct rng* rng) {\n");
+	fprintf(f, "\tstruct identity* id = world->identities + identity;\n");
+	fprintf(f, "\treturn id->member_count == 0 ? get(world, x, y) : id->members[random32(rng) %% id->member_count];\n");
+	fprintf(f, "}\n\n");
+	for(int r = 0; r < world->n_rules; r++) {
+		writeFits(world, f, r);
+		writeEnforce(world, f, r);
+	}
+	fprintf(f, "static const struct compiled_rule rules[%d] = {\n", world->n_rules > 0 ? world->n_rules : 1);
+	for(int r = 0; r < world->n_rules; r++)
+		fprintf(f, "\t{0x%016llxull, fits%d, enforce%d},\n", (unsigned long long)ruleFingerprint(world->rules + r), r, r);
+	fprintf(f, "};\n\n");
+	fprintf(f, "const struct sand_compiled sand_compiled_rules = {%d, rules};\n", world->n_rules);
+	fclose(f);
+	return true;
+}
+
+bool sandUseCompiled(struct sand_world* world, const struct sand_compiled* compiled) {
+	int mismatched = 0;
+	for(int r = 0; r < world->n_rules; r++)
+		if(r >= compiled->n_rules || compiled->rules[r].fingerprint != ruleFingerprint(world->rules + r))
+			mismatched++;
+	if(mismatched > 0 || compiled->n_rules != world->n_rules) {
+		printf("\033[0;31m%d of %d loaded rules don't match the compiled ruleset of %d rules, running them interpreted\033[0m\n",
+			mismatched, world->n_rules, compiled->n_rules);
+		return false;
+	}
+	for(int r = 0; r < world->n_rules; r++)
+		world->rules[r].compiled = compiled->rules + r;
+	return true;
+}
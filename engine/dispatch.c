@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// Anchor dispatch. Every rule is keyed on one of its non-wildcard cells, its anchor. Before each sweep the
+// rules are spread over a table indexed by anchor and element, so at each position the sweep reads the
+// anchor cells once and only tries the rules that could match there.
+
+bool acceptsElement(struct sand_world* world, struct match_t match, uint16_t element) {
+	if(match.type == -1)
+		return true;
+	if(match.type == 0)
+		return match.value == element;
+	return (world->masks[element] >> match.value) & 1;
+}
+
+int acceptedCount(struct sand_world* world, struct match_t match) {
+	int count = 0;
+	for(uint32_t e = 0; e < world->n_elements; e++)
+		if(acceptsElement(world, match, e))
+			count++;
+	return count;
+}
+
+// The center cell if it isn't a wildcard, otherwise whichever cell accepts the fewest elements
+void chooseAnchors(struct sand_world* world) {
+	world->n_anchors = 0;
+	world->reach_ok = true;
+	for(int r = 0; r < world->n_rules; r++) {
+		struct rule* rule = world->rules + r;
+		// Chunks swept at the same time are a chunk apart. A replacement that copies from further away
+		// than that could read cells another thread is writing, such rulesets are swept on one thread
+		for(int j = 0; j < 5; j++)
+			for(int i = 0; i < 5; i++)
+				if(rule->replace[j][i].type == 1 || rule->replace[j][i].type == 2)
+					if(abs(rule->replace[j][i].refX) > CHUNK_SIZE-4 || abs(rule->replace[j][i].refY) > CHUNK_SIZE-4)
+						world->reach_ok = false;
+		rule->anchor = -1;
+		if(rule->match[2][2].type != -1)
+			rule->anchor = 2*5+2;
+		else {
+			int best = 0;
+			for(int j = 0; j < 5; j++)
+				for(int i = 0; i < 5; i++) {
+					if(rule->match[j][i].type == -1)
+						continue;
+					int count = acceptedCount(world, rule->match[j][i]);
+					if(rule->anchor == -1 || count < best) {
+						rule->anchor = j*5+i;
+						best = count;
+					}
+				}
+		}
+		if(rule->anchor == -1)
+			continue;
+		rule->anchor_group = -1;
+		for(int g = 0; g < world->n_anchors; g++)
+			if(world->anchors[g] == rule->anchor)
+				rule->anchor_group = g;
+		if(rule->anchor_group == -1) {
+			rule->anchor_group = world->n_anchors;
+			world->anchors[world->n_anchors++] = rule->anchor;
+		}
+	}
+}
+
+static void computeSlots(struct sand_world* world, int group, uint16_t element, struct slots* slots) {
+	memset(slots, 0, sizeof(struct slots));
+	for(int s = 0; s < world->n_rules; s++) {
+		struct rule* rule = world->rules + world->slot_rules[s];
+		if(rule->anchor != -1 && rule->anchor_group == group
+			&& acceptsElement(world, rule->match[rule->anchor/5][rule->anchor%5], element))
+			slots->bits[s / 64] |= (uint64_t)1 << (s % 64);
+	}
+}
+
+// Every rule gets a slot each sweep. At a position the rules are tried in slot order, and where two of them
+// compete for the same cells the first one wins, so the order is drawn anew from the seed every sweep
+void buildDispatch(struct sand_world* world) {
+	struct rng rng;
+	seedRandom(&rng, world->seed, world->iteration, -1);
+	for(int s = 0; s < world->n_rules; s++)
+		world->slot_rules[s] = s;
+	for(int s = world->n_rules - 1; s > 0; s--) {
+		int k = random32(&rng) % (s + 1);
+		int swap = world->slot_rules[s];
+		world->slot_rules[s] = world->slot_rules[k];
+		world->slot_rules[k] = swap;
+	}
+	world->slot_words = (world->n_rules + 63) / 64;
+
+	if(world->n_elements * world->n_anchors > world->dispatch_capacity) {
+		world->dispatch_capacity = world->n_elements * world->n_anchors;
+		world->dispatch = (struct slots*)realloc(world->dispatch, sizeof(struct slots)*world->dispatch_capacity);
+	}
+	world->dispatch_elements = world->n_elements;
+
+	memset(&world->dispatch_always, 0, sizeof(struct slots));
+	for(int s = 0; s < world->n_rules; s++) {
+		if(world->rules[world->slot_rules[s]].anchor == -1)
+			world->dispatch_always.bits[s / 64] |= (uint64_t)1 << (s % 64);
+		world->rule_slots[world->slot_rules[s]] = s;
+	}
+	for(int g = 0; g < world->n_anchors; g++)
+		for(uint32_t e = 0; e < world->dispatch_elements; e++)
+			computeSlots(world, g, e, world->dispatch + g*world->dispatch_elements + e);
+}
+
+// Slots of the sweep whose rules could match at (x, y)
+void candidates(struct sand_world* world, int x, int y, struct slots* slots) {
+	// Whole sets, the words past slot_words are zero. A fixed count unrolls
+	*slots = world->dispatch_always;
+	for(int g = 0; g < world->n_anchors; g++) {
+		uint16_t element = get(world, x + world->anchors[g]%5, y + world->anchors[g]/5);
+		struct slots interned;
+		const struct slots* accepted = &interned;
+		if(element < world->dispatch_elements)
+			accepted = world->dispatch + g*world->dispatch_elements + element;
+		else // Interned since the table was built
+			computeSlots(world, g, element, &interned);
+		for(int w = 0; w < SLOT_WORDS; w++)
+			slots->bits[w] |= accepted->bits[w];
+	}
+}
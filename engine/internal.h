@@ -0,0 +1,496 @@
+#ifndef SAND_INTERNAL_H
+#define SAND_INTERNAL_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#ifdef SAND_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+#include "sand.h"
+
+// Defaults for the sweep, see sandSetSweep
+#define ITERATIONS 4
+#define STEPPING 2
+#define MAX_STEPPING 5 // Wider steps would leave cells that no 5x5 window covers
+// Rules with a lower chance skip ahead to their next try instead of rolling every time, see rollSlot
+#define SAMPLE_BELOW 0.05
+#define MAX_RULES 256
+#define SLOT_WORDS (MAX_RULES / 64)
+#define CHUNK_SIZE 32 // At most 55, settled() checks a chunk's row of positions with one fitsRow
+#define TILE_SIZE 8 // Smallest blocks of the presence pyramid, at most a quarter of CHUNK_SIZE so chunks swept in parallel never share one
+#define MAX_LEVELS 16
+
+// Cells store element IDs, colors only come in when rendering. Elements are interned as rules load them,
+// and colors made at runtime by edit (type 2) replacements are interned as they appear
+#define MAX_ELEMENTS 65536
+// Every identity gets a bit in an element's identity mask
+#define MAX_IDENTITIES 64
+
+#define COL SAND_COL
+#define AIR SAND_AIR
+// AIR is interned first, so out of bounds cells and fresh worlds are element 0
+#define AIR_ID 0
+
+// Per task random stream, xoshiro256**. Streams are seeded from the world's seed, the iteration and the
+// chunk being swept, so a fixed seed gives the same world whatever the number of threads
+struct rng {
+	uint64_t s[4];
+};
+
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// FNV-1a, for fingerprints and keys of things that are only read once
+static inline uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for(size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+#define HASH_START 14695981039346656037ull
+
+// LEB128, for snapshots and recordings. getVarint fails at 'end' or past 32 bits
+static inline int putVarint(uint8_t* out, uint32_t value) {
+	int n = 0;
+	for(; value >= 0x80; value >>= 7)
+		out[n++] = (value & 0x7f) | 0x80;
+	out[n++] = value;
+	return n;
+}
+
+static inline bool getVarint(const uint8_t** at, const uint8_t* end, uint32_t* value) {
+	uint32_t v = 0;
+	for(int shift = 0; shift < 32 && *at < end; shift += 7) {
+		uint8_t byte = *(*at)++;
+		v |= (uint32_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80)) {
+			*value = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifdef SAND_PROFILE
+// What the sweep has done with a rule, see profile.c. Of the offers the dispatch made, 'chance' were turned
+// down by the rule's chance, 'misses' didn't fit (and 'potential' of those already failed potential())
+// and 'matches' were enforced. 'cycles' is the time spent on all of them
+struct rule_profile {
+	uint64_t offered, chance, misses, potential, matches, cycles;
+};
+
+// Timestamp counter where there is one, nanoseconds elsewhere
+static inline uint64_t profileClock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+#endif
+}
+#endif
+
+static inline void seedRandom(struct rng* rng, uint64_t seed, uint64_t iteration, int64_t stream) {
+	// splitmix64 over the key fills the state, it can't come out all zero
+	uint64_t key = seed + mix64(iteration + mix64((uint64_t)stream));
+	for(int i = 0; i < 4; i++) {
+		key += 0x9e3779b97f4a7c15ull;
+		rng->s[i] = mix64(key);
+	}
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t random64(struct rng* rng) {
+	uint64_t* s = rng->s;
+	uint64_t result = rotl64(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl64(s[3], 45);
+	return result;
+}
+
+static inline uint32_t random32(struct rng* rng) {
+	return (uint32_t)(random64(rng) >> 32);
+}
+
+// Uniform in (0, 1]
+static inline double randomUnit(struct rng* rng) {
+	return ((random64(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// Set of a sweep's slots, slot s at bit s%64 of bits[s/64]. Only the world's first slot_words words are used
+struct slots {
+	uint64_t bits[SLOT_WORDS];
+};
+
+// Which identities and elements might be in an area. Elements are hashed to one of 64 bits, see elementSlot
+struct presence {
+	uint64_t identities;
+	uint64_t elements;
+};
+
+static inline int elementSlot(uint16_t element) {
+	return ((uint32_t)element * 40503u >> 10) & 63;
+}
+
+// Whether every identity and element 'needs' asks for might be in 'have'
+static inline bool presenceCovers(struct presence have, struct presence needs) {
+	return ((needs.identities & ~have.identities) | (needs.elements & ~have.elements)) == 0;
+}
+
+struct tile {
+	uint8_t counts[128]; // Cells per identity bit, then per element bit
+	struct presence presence; // Bits whose count isn't 0
+};
+
+struct level {
+	int size; // Cells along a block's side
+	int blocks_x, blocks_y;
+	struct presence* blocks;
+	// Blocks to rebuild at the end of the iteration
+	bool* dirty;
+	int* dirty_list;
+	int n_dirty;
+};
+
+struct identity {
+	const char* name;
+	uint32_t member_count;
+	uint16_t* members; // Elements of an identity, say, "solid"
+};
+
+struct match_t {
+	// -1 - match anything, 0 - exact element, 1 - identity
+	int8_t type;
+	// element ID for type 0, identity index (and bit in the element masks) for type 1
+	uint32_t value;
+	// char* identity;
+};
+
+#define REGION_ENTRIES 30
+
+// Element counts of a chunk, kept exact by put(). See chunk.c
+struct region {
+	// element << 16 | count, 0 when free. A chunk holds at most CHUNK_SIZE^2 cells, so counts fit 16 bits
+	uint32_t entries[REGION_ENTRIES];
+	// Cells not counted in 'entries' because it was full, while there are any, element lookups can't rule anything out
+	uint32_t overflow;
+	uint16_t identity_counts[MAX_IDENTITIES];
+	uint64_t identities; // Bit i is set while identity_counts[i] > 0
+	// Writers take the lock, and bump 'version' around their changes so readers can check they saw a consistent region
+	uint32_t version;
+	uint8_t lock;
+};
+
+struct chunk {
+	// Summary of the chunk's elements for potential()
+	struct region region;
+	// A cell in the chunk was written this iteration
+	bool changed;
+	// Iterations since the chunk or a neighbor last changed, the chunk sleeps once this reaches sleep_after
+	uint16_t quiet;
+	// The chunk is in the awake or woken list
+	bool listed;
+};
+
+struct replace_t {
+	int8_t type;
+	int8_t refX, refY;
+	uint32_t value;
+	// const char* identity;
+	// type = -1 -> do not replace
+	// type = 0 -> replace with element 'value'
+	// type = 1 -> replace with color of the pixel that is (refX, refY) away from the current position. if a referenced cell is out of bounds, it will return AIR
+	// type = 2 -> replace with color of the pixel referenced by (refX, refY) as seen above, with changes to the red, green, and blue of the color as laid out by 'value'
+	//					which, in this case, will be composed of 4 signed 'int8_t's, value = 0x XX'XX'XX'XX, each XX->signed 8 bit int
+	// type = 3 -> replace with a random entry in the given identity
+};
+
+// A non-wildcard cell of a rule's match block, see program.c
+struct check {
+	int32_t offset; // Of the cell from the rule's position in world->cells
+	int8_t cell; // j*5+i in the match block
+	int8_t type;
+	int accepted; // Number of elements the cell accepts, when compiled
+	uint32_t value;
+};
+
+struct box {
+	int8_t left, right, top, bottom;
+};
+
+// A rule compiled to C ahead of time, see codegen.c
+struct compiled_rule {
+	uint64_t fingerprint;
+	bool (*fits)(struct sand_world* world, int x, int y);
+	void (*enforce)(struct sand_world* world, int x, int y, struct rng* rng);
+};
+
+struct sand_compiled {
+	int n_rules;
+	const struct compiled_rule* rules;
+};
+
+struct rule {
+	// match_t is a type that will be used to determine whether a color matches a rule or not
+	struct match_t match[5][5];
+	// the "search_for" contains all unique match_t's, to see if a region has all the elements used in the match block
+	struct match_t* search_for;
+	int num_search_for;
+	// search_for as presence bits, checked against the pyramid before anything else
+	struct presence needs;
+	// replace_t is a type that will be used to determine how each cell confined by the rule should be changed
+	struct replace_t replace[5][5];
+
+	// Number between 0 and 1 that determines randomly if the rule will proceed, or just fail
+	float chance;
+	// chance scaled to 2^32, a 32 bit draw below it passes
+	uint32_t threshold;
+	// log(1 - chance), for drawing the number of offers skipped between tries of rare rules, see sampleSkip
+	double log_fail;
+
+	// Cell (j*5+i) the rule is dispatched on, -1 if every cell is a wildcard. See dispatch.c
+	int8_t anchor;
+	int8_t anchor_group; // Index of 'anchor' in sand_world.anchors
+
+	// The non-wildcard cells, most selective first and the anchor last
+	struct check program[25];
+	int8_t n_checks;
+	// Box around the checks, the rule only fits where it's in the world. Empty (left > right) if there are none
+	struct box footprint;
+
+	// Generated code for the rule, if attached with sandUseCompiled. fits and enforce defer to it
+	const struct compiled_rule* compiled;
+	// Where it was written, "file.ruleset:line", and " x", " y" or " xy" for a mirror. For reports
+	char origin[40];
+};
+
+struct sand_world {
+	int width, height;
+	uint16_t* cells;
+
+	// Palette, indexed by element ID
+	uint32_t* colors;
+	uint64_t* masks; // Bit i is set if the element is a member of identities[i]
+	uint32_t n_elements;
+	uint32_t* color_index; // Open addressed color -> element ID + 1 lookup, 0 is empty
+	pthread_mutex_t palette_lock;
+
+	struct identity* identities;
+	int n_identities;
+
+	struct rule* rules;
+	int n_rules;
+	uint32_t step;
+
+	// Sweeps per sandStep, and the distance between swept positions, see sandSetSweep
+	int iterations, stepping;
+	// Quiet iterations before a chunk is checked for sleeping, long enough for every stepping offset to have been swept
+	int sleep_after;
+
+	// Distinct anchor cells of the loaded rules
+	int8_t anchors[25];
+	int n_anchors;
+	// Every rule gets a slot each sweep, in the sweep's order, see buildDispatch. The rule in each slot and
+	// each rule's slot, and [anchor group][element] -> slots whose rule accepts the element at that anchor
+	int slot_rules[MAX_RULES];
+	int rule_slots[MAX_RULES];
+	int slot_words; // Words of a slot set in use
+	struct slots* dispatch;
+	uint32_t dispatch_elements, dispatch_capacity;
+	struct slots dispatch_always; // Slots whose rule has no anchor
+
+	// Discrimination network, used instead of anchor dispatch when enabled. See network.c
+	struct network* network;
+	bool use_network;
+	bool network_stale; // Rules were loaded since it was built
+	struct watch* watch; // Of the rules directory, see sandWatchRules
+	struct checkpoint* checkpoint; // Being written, see sandCheckpoint
+	struct recording* recording; // See sandRecord
+	struct view* view; // Published for drawing, see sandPublish
+	struct worklist* worklist; // Positions to sweep, NULL to sweep them all. See sandSetWorklist
+
+	struct chunk* chunks;
+	int chunks_x, chunks_y;
+	// Chunks that were awake at the end of the last iteration, and chunks woken since. Only these are
+	// visited, so a mostly settled world costs next to nothing however large it is
+	int* awake;
+	int n_awake;
+	int* woken;
+	int n_woken;
+
+	// Presence pyramid, see presence.c. levels[0] has a block per chunk
+	struct tile* tiles;
+	int tiles_x, tiles_y;
+	struct level levels[MAX_LEVELS];
+	int n_levels;
+
+	struct pool* pool;
+	struct pool* serial; // Single threaded pool, for rulesets that reach too far to be swept in parallel
+	bool reach_ok; // Whether every loaded rule stays within reach of its own chunk, see chooseAnchors
+	int* tasks; // Chunks to sweep in the current pass, or to update
+	// Positions at least one rule can fit at, see compileRules
+	int sweep_left, sweep_right, sweep_top, sweep_bottom;
+	uint64_t seed;
+	uint64_t iteration;
+	// Rules checked and enforced since the world was created, see sandCounts
+	uint64_t evaluations, matches;
+#ifdef SAND_PROFILE
+	// Counters of each rule for each worker of the pool, [worker*MAX_RULES + rule], and writes per cell
+	struct rule_profile* profile;
+	int profile_workers;
+	uint32_t* heat;
+#endif
+
+	uint32_t binds[256]; // Color bound to each key, by its upper case byte, see sandBind
+};
+
+// sand.c
+void put(struct sand_world* world, uint16_t element, int x, int y);
+uint16_t get(struct sand_world* world, int x, int y);
+bool potential(struct sand_world* world, const struct rule* rule, int x, int y);
+bool fits(struct sand_world* world, const struct rule* rule, int x, int y);
+void enforce(struct sand_world* world, const struct rule* rule, int x, int y, struct rng* rng);
+
+// chunk.c
+bool regionHas(struct sand_world* world, struct region *r, struct match_t t);
+void createChunks(struct sand_world* world);
+void destroyChunks(struct sand_world* world);
+struct chunk* positionChunk(struct sand_world* world, int x, int y);
+void chunkPositions(struct sand_world* world, int cx, int cy, int* left, int* right, int* top, int* bottom);
+int possibleRules(struct sand_world* world, int cx, int cy, int* possible);
+void regionMove(struct sand_world* world, struct region* r, uint16_t from, uint16_t to);
+void touch(struct sand_world* world, int x, int y);
+void wakeAll(struct sand_world* world);
+void rebuildRegions(struct sand_world* world);
+void updateChunks(struct sand_world* world);
+
+// dispatch.c
+bool acceptsElement(struct sand_world* world, struct match_t match, uint16_t element);
+int acceptedCount(struct sand_world* world, struct match_t match);
+void chooseAnchors(struct sand_world* world);
+void buildDispatch(struct sand_world* world);
+void candidates(struct sand_world* world, int x, int y, struct slots* slots);
+
+// program.c
+void compileRules(struct sand_world* world);
+
+// kernel.c
+uint64_t fitsRow(struct sand_world* world, const struct rule* rule, int x, int y, int n, uint64_t among);
+
+// network.c
+bool buildNetwork(struct sand_world* world);
+void destroyNetwork(struct sand_world* world);
+void networkSlots(struct sand_world* world, int x, int y, struct slots* slots);
+
+// presence.c
+void createPresence(struct sand_world* world);
+void destroyPresence(struct sand_world* world);
+void presenceMove(struct sand_world* world, uint16_t from, uint16_t to, int x, int y);
+void presenceChanged(struct sand_world* world, int chunk);
+void rebuildPresence(struct sand_world* world);
+void recountPresence(struct sand_world* world);
+struct presence tilePresence(struct sand_world* world, int left, int top, int right, int bottom);
+struct presence presenceOf(struct sand_world* world, int left, int top, int right, int bottom);
+
+// pool.c
+struct pool;
+struct pool* createPool(int n_threads);
+void destroyPool(struct pool* pool);
+int poolThreads(struct pool* pool);
+void poolRun(struct pool* pool, int n_tasks, void (*run)(void* context, int task, int worker), void* context);
+
+// palette.c
+void createPalette(struct sand_world* world);
+void destroyPalette(struct sand_world* world);
+uint16_t intern(struct sand_world* world, uint32_t color);
+
+// rules.c
+int findIdentity(struct sand_world* world, const char* name, int length);
+bool isIdentity(struct sand_world* world, const uint32_t identity_index, uint16_t element);
+bool matchCmp(const struct match_t a, const struct match_t b);
+void finishRule(struct rule* rule, const struct rule* original);
+void clearRules(struct sand_world* world);
+struct parsed_rules;
+struct parsed_rules* parseDirectory(const char* directory);
+void freeParsedRules(struct parsed_rules* parsed);
+bool replaceRules(struct sand_world* world, struct parsed_rules* parsed);
+
+// watch.c
+void stopWatch(struct sand_world* world);
+void reloadRules(struct sand_world* world);
+
+// cache.c
+// A ruleset file as read, in the order the directory listed it
+struct rule_file {
+	char* path;
+	const char* name; // Within the directory
+	char* text;
+	size_t size;
+};
+uint64_t cacheKey(const struct rule_file* files, int n_files);
+bool loadCache(struct sand_world* world, const char* path, uint64_t key);
+void writeCache(struct sand_world* world, const char* path, uint64_t key);
+const uint8_t* mapFile(const char* path, size_t* size);
+void unmapFile(const uint8_t* data, size_t size);
+FILE* createReplacement(const char* path, char** temporary);
+bool replaceFile(FILE* f, char* temporary, const char* path, bool written, const char* what);
+
+// snapshot.c
+void preserveAround(struct sand_world* world, int chunk);
+void preserveCell(struct sand_world* world, int x, int y);
+void reapCheckpoint(struct sand_world* world);
+
+// profile.c
+void createProfile(struct sand_world* world);
+void destroyProfile(struct sand_world* world);
+void resizeProfile(struct sand_world* world);
+
+// worklist.c
+// Bitsets over the sweep positions, (x + 4, y + 4), rows of 'words' words
+struct worklist {
+	int words;
+	uint64_t* live; // Positions that might do something when swept
+	uint64_t* pending; // Written since they were last checked for settling
+	uint64_t* fresh; // Written since their chunk last checked, not checked until they've been quiet for a while
+};
+void worklistWrite(struct sand_world* world, int x, int y);
+void worklistEverything(struct sand_world* world);
+void retireSettled(struct sand_world* world);
+void destroyWorklist(struct sand_world* world);
+
+// Whether sweeping (x, y) might do something. Positions written since their chunk was last checked are only
+// marked fresh
+static inline bool positionLive(const struct worklist* list, int x, int y) {
+	size_t w = (size_t)(y + 4)*list->words + (x + 4) / 64;
+	uint64_t live = __atomic_load_n(&list->live[w], __ATOMIC_RELAXED) | __atomic_load_n(&list->fresh[w], __ATOMIC_RELAXED);
+	return (live >> ((x + 4) % 64)) & 1;
+}
+
+// view.c
+void destroyView(struct sand_world* world);
+void viewChanged(struct sand_world* world, int chunk);
+void viewEverything(struct sand_world* world);
+
+// record.c
+void recordChanged(struct sand_world* world, int chunk);
+void recordEverything(struct sand_world* world);
+void recordStep(struct sand_world* world);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stddef.h>
+#include "internal.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Row match kernel. Checks a rule's program at up to 64 neighboring positions of a row at once: each
+// exact check compares a slice of the row against the element 16 (SSE2) or 32 (AVX2) cells at a time,
+// identity checks look the masks up for the positions still standing. Builds without either on other
+// machines, with the scalar loop.
+//
+// The sleep check scans whole rows of a chunk with no writes in between, which is where this pays. The
+// sweep keeps calling fits(): it writes between positions, and dispatch leaves too few tries per row
+// for checking whole rows to win.
+
+// Bits of the positions x..x+n-1 whose cells at 'row' equal 'value'
+static uint64_t equalBits(const uint16_t* row, int n, uint16_t value) {
+	uint64_t bits = 0;
+	int k = 0;
+#if defined(__AVX2__)
+	__m256i want = _mm256_set1_epi16(value);
+	for(; k + 32 <= n; k += 32) {
+		__m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(row + k)), want);
+		__m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(row + k + 16)), want);
+		// packs works within 128 bit lanes, put the quarters back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+		bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(packed) << k;
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i want16 = _mm_set1_epi16(value);
+	for(; k + 16 <= n; k += 16) {
+		__m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(row + k)), want16);
+		__m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(row + k + 8)), want16);
+		bits |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << k;
+	}
+#endif
+	for(; k < n; k++)
+		bits |= (uint64_t)(row[k] == value) << k;
+	return bits;
+}
+
+// Bit k is set if the rule's match block fits at (x+k, y), for k < n <= 64 and bit k set in 'among'. Like
+// fits, without the presence prefilter: the cells themselves are checked
+uint64_t fitsRow(struct sand_world* world, const struct rule* rule, int x, int y, int n, uint64_t among) {
+	// Only the positions that keep every checked cell in the world can fit. A rule of only wildcards fits
+	// wherever its window overlaps the world
+	struct box box = rule->n_checks > 0 ? rule->footprint : (struct box){4, 0, 4, 0};
+	if(y + box.top < 0 || y + box.bottom >= world->height)
+		return 0;
+	int first = x + box.left < 0 ? -box.left - x : 0;
+	int last = x + n - 1 + box.right >= world->width ? world->width - 1 - box.right - x : n - 1;
+	if(first > last)
+		return 0;
+	int count = last - first + 1;
+	uint64_t bits = (count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1) & among >> first;
+	const uint16_t* cells = world->cells + x + first + (ptrdiff_t)y * world->width;
+	for(int c = 0; c < rule->n_checks && bits; c++) {
+		const struct check* check = rule->program + c;
+		const uint16_t* row = cells + check->offset;
+		// Once few positions are left, looking them up one by one is cheaper than comparing the whole slice
+		if(check->type == 0 && __builtin_popcountll(bits) > 4)
+			bits &= equalBits(row, count, check->value);
+		else
+			for(uint64_t left = bits; left; left &= left - 1) {
+				int k = __builtin_ctzll(left);
+				uint16_t element = row[k];
+				if(check->type == 0 ? element != check->value : !((world->masks[element] >> check->value) & 1))
+					bits &= ~((uint64_t)1 << k);
+			}
+	}
+	return bits << first;
+}
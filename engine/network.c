@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// Discrimination network, the alternative to anchor dispatch (see sandSetNetwork). All loaded rules are
+// compiled together, Baker-Bird style: a rule fits where each of its five rows fits, so there is one
+// decision graph per row of the window. A node reads one cell of the row and follows the edge of the
+// cell's class, the elements that the rules accept at that cell in the same way. Every path reads a cell
+// at most once and ends in a leaf listing the rules whose row accepted what was read. The rules that fit
+// at a position are those in all five leaves. Nodes with the same rules left and the same cells read
+// are shared.
+//
+// One graph over all 25 cells would skip the intersection, but it grows exponentially with the number of
+// cells its paths read: the bundled rules take well over 16 million nodes. The row graphs stay small.
+
+#define MAX_NETWORK_NODES (1 << 20)
+#define RULE_WORDS (MAX_RULES / 64)
+
+struct ruleset {
+	uint64_t bits[RULE_WORDS];
+};
+
+struct node {
+	int8_t cell; // j*5+i, -1 for a leaf
+	int32_t next; // First of the cell's class edges in 'edges', or for a leaf its rules in 'leaves'
+};
+
+// Built nodes, open addressed by rules left and cells read
+struct memo {
+	struct ruleset rules;
+	uint32_t read;
+	int32_t node; // -1 when free
+};
+
+struct row_graph {
+	struct node* nodes;
+	int n_nodes, nodes_capacity;
+	int32_t* edges;
+	int n_edges, edges_capacity;
+	struct ruleset* leaves;
+	int n_leaves, leaves_capacity;
+	int root;
+};
+
+struct network {
+	uint32_t elements; // Elements the class tables cover
+	uint16_t* classes; // [cell*elements + element]
+	int n_classes[25];
+	// Class of out of bounds cells, which only wildcards accept. Elements interned after the build are
+	// colors made by edit replacements, which belong to no identity, so they fall in it too
+	uint16_t outside[25];
+	struct ruleset* class_rules[25]; // Rules that accept the class at the cell
+	struct ruleset wildcards[25]; // Rules with a wildcard at the cell
+
+	struct row_graph rows[5];
+	struct memo* memo; // While building
+	int memo_capacity;
+};
+
+static uint64_t hashKey(const struct ruleset* set, uint32_t read) {
+	uint64_t h = mix64(read);
+	for(int w = 0; w < RULE_WORDS; w++)
+		h = mix64(h ^ set->bits[w]);
+	return h;
+}
+
+static struct memo* findMemo(struct network* net, const struct ruleset* set, uint32_t read) {
+	uint64_t h = hashKey(set, read) % net->memo_capacity;
+	for(;;) {
+		struct memo* m = net->memo + h;
+		if(m->node == -1 || (m->read == read && memcmp(&m->rules, set, sizeof(struct ruleset)) == 0))
+			return m;
+		h = (h + 1) % net->memo_capacity;
+	}
+}
+
+static void growMemo(struct network* net) {
+	struct memo* old = net->memo;
+	int old_capacity = net->memo_capacity;
+	net->memo_capacity = old_capacity ? old_capacity*2 : 1024;
+	net->memo = (struct memo*)malloc(sizeof(struct memo)*net->memo_capacity);
+	for(int m = 0; m < net->memo_capacity; m++)
+		net->memo[m].node = -1;
+	for(int m = 0; m < old_capacity; m++)
+		if(old[m].node != -1)
+			*findMemo(net, &old[m].rules, old[m].read) = old[m];
+	free(old);
+}
+
+static int addNode(struct row_graph* graph, int cell, int next) {
+	if(graph->n_nodes == graph->nodes_capacity) {
+		graph->nodes_capacity = graph->nodes_capacity ? graph->nodes_capacity*2 : 256;
+		graph->nodes = (struct node*)realloc(graph->nodes, sizeof(struct node)*graph->nodes_capacity);
+	}
+	graph->nodes[graph->n_nodes].cell = cell;
+	graph->nodes[graph->n_nodes].next = next;
+	return graph->n_nodes++;
+}
+
+// Node for the rules still in the running after reading the cells in 'read' of row 'row', -1 if the graph
+// grew too large
+static int buildNode(struct network* net, struct row_graph* graph, int row, struct ruleset rules, uint32_t read) {
+	struct memo* m = findMemo(net, &rules, read);
+	if(m->node != -1)
+		return m->node;
+	if(graph->n_nodes >= MAX_NETWORK_NODES)
+		return -1;
+
+	// Read the unread cell that the most remaining rules check
+	int cell = -1, best = 0;
+	for(int c = row*5; c < row*5 + 5; c++) {
+		if((read >> c) & 1)
+			continue;
+		int checked = 0;
+		for(int w = 0; w < RULE_WORDS; w++)
+			checked += __builtin_popcountll(rules.bits[w] & ~net->wildcards[c].bits[w]);
+		if(checked > best) {
+			cell = c;
+			best = checked;
+		}
+	}
+
+	int node;
+	if(cell == -1) {
+		// Every remaining rule has had its row checked
+		if(graph->n_leaves == graph->leaves_capacity) {
+			graph->leaves_capacity = graph->leaves_capacity ? graph->leaves_capacity*2 : 256;
+			graph->leaves = (struct ruleset*)realloc(graph->leaves, sizeof(struct ruleset)*graph->leaves_capacity);
+		}
+		graph->leaves[graph->n_leaves] = rules;
+		node = addNode(graph, -1, graph->n_leaves++);
+	} else {
+		int n_classes = net->n_classes[cell];
+		if(graph->n_edges + n_classes > graph->edges_capacity) {
+			graph->edges_capacity = (graph->n_edges + n_classes)*2;
+			graph->edges = (int32_t*)realloc(graph->edges, sizeof(int32_t)*graph->edges_capacity);
+		}
+		int first = graph->n_edges;
+		graph->n_edges += n_classes;
+		node = addNode(graph, cell, first);
+		for(int k = 0; k < n_classes; k++) {
+			struct ruleset next;
+			for(int w = 0; w < RULE_WORDS; w++)
+				next.bits[w] = rules.bits[w] & net->class_rules[cell][k].bits[w];
+			int child = buildNode(net, graph, row, next, read | (uint32_t)1 << cell);
+			if(child == -1)
+				return -1;
+			graph->edges[first + k] = child;
+		}
+	}
+
+	if(2*(graph->n_nodes + 1) > net->memo_capacity)
+		growMemo(net);
+	m = findMemo(net, &rules, read);
+	m->rules = rules;
+	m->read = read;
+	m->node = node;
+	return node;
+}
+
+// Split the elements at each cell into classes of the same accepting rules
+static void classify(struct sand_world* world, struct network* net) {
+	uint32_t elements = net->elements;
+	net->classes = (uint16_t*)malloc(sizeof(uint16_t)*25*elements);
+	struct ruleset* accepted = (struct ruleset*)malloc(sizeof(struct ruleset)*(elements + 1));
+	for(int c = 0; c < 25; c++) {
+		// Element 'elements' stands for out of bounds
+		memset(accepted, 0, sizeof(struct ruleset)*(elements + 1));
+		for(int r = 0; r < world->n_rules; r++) {
+			struct match_t match = world->rules[r].match[c/5][c%5];
+			for(uint32_t e = 0; e <= elements; e++)
+				if(match.type == -1 || (e < elements && acceptsElement(world, match, e)))
+					accepted[e].bits[r/64] |= (uint64_t)1 << (r%64);
+		}
+		net->wildcards[c] = accepted[elements];
+
+		net->class_rules[c] = (struct ruleset*)malloc(sizeof(struct ruleset)*(elements + 1));
+		net->n_classes[c] = 0;
+		for(uint32_t e = 0; e <= elements; e++) {
+			int k = 0;
+			while(k < net->n_classes[c] && memcmp(net->class_rules[c] + k, accepted + e, sizeof(struct ruleset)) != 0)
+				k++;
+			if(k == net->n_classes[c])
+				net->class_rules[c][net->n_classes[c]++] = accepted[e];
+			if(e < elements)
+				net->classes[c*elements + e] = k;
+			else
+				net->outside[c] = k;
+		}
+	}
+	free(accepted);
+}
+
+void destroyNetwork(struct sand_world* world) {
+	struct network* net = world->network;
+	if(net == NULL)
+		return;
+	free(net->classes);
+	for(int c = 0; c < 25; c++)
+		free(net->class_rules[c]);
+	for(int j = 0; j < 5; j++) {
+		free(net->rows[j].nodes);
+		free(net->rows[j].edges);
+		free(net->rows[j].leaves);
+	}
+	free(net->memo);
+	free(net);
+	world->network = NULL;
+}
+
+// Compile the loaded rules, returns false if the network would have grown too large
+bool buildNetwork(struct sand_world* world) {
+	destroyNetwork(world);
+	struct network* net = (struct network*)calloc(1, sizeof(struct network));
+	world->network = net;
+	net->elements = world->n_elements;
+	classify(world, net);
+
+	struct ruleset all;
+	memset(&all, 0, sizeof(all));
+	for(int r = 0; r < world->n_rules; r++)
+		all.bits[r/64] |= (uint64_t)1 << (r%64);
+	for(int j = 0; j < 5; j++) {
+		free(net->memo);
+		net->memo = NULL;
+		net->memo_capacity = 0;
+		growMemo(net);
+		struct row_graph* graph = net->rows + j;
+		graph->root = buildNode(net, graph, j, all, 0);
+		if(graph->root == -1) {
+			destroyNetwork(world);
+			return false;
+		}
+	}
+	free(net->memo);
+	net->memo = NULL;
+	return true;
+}
+
+// Slots of the sweep whose rules fit at (x, y), ignoring their chance
+void networkSlots(struct sand_world* world, int x, int y, struct slots* slots) {
+	const struct network* net = world->network;
+	memset(slots, 0, sizeof(struct slots));
+	struct ruleset fit;
+	memset(&fit, 0xff, sizeof(fit));
+	// The middle rows first, rules check them the most
+	static const int order[5] = {2, 1, 3, 0, 4};
+	for(int r = 0; r < 5; r++) {
+		const struct row_graph* graph = net->rows + order[r];
+		const struct node* node = graph->nodes + graph->root;
+		int j = y + order[r];
+		bool outside_row = j < 0 || j >= world->height;
+		const uint16_t* cells = world->cells + (size_t)(outside_row ? 0 : j)*world->width;
+		while(node->cell != -1) {
+			int i = x + node->cell%5;
+			int k;
+			if(outside_row || i < 0 || i >= world->width || cells[i] >= net->elements)
+				k = net->outside[node->cell];
+			else
+				k = net->classes[node->cell*net->elements + cells[i]];
+			node = graph->nodes + graph->edges[node->next + k];
+		}
+		uint64_t any = 0;
+		for(int w = 0; w < RULE_WORDS; w++)
+			any |= fit.bits[w] &= graph->leaves[node->next].bits[w];
+		if(!any)
+			return;
+	}
+	for(int w = 0; w < RULE_WORDS; w++)
+		for(uint64_t bits = fit.bits[w]; bits; bits &= bits - 1) {
+			int slot = world->rule_slots[w*64 + __builtin_ctzll(bits)];
+			slots->bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+		}
+}
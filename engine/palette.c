@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "internal.h"
+
+#define COLOR_INDEX_SIZE (MAX_ELEMENTS*2)
+
+static uint32_t colorHash(uint32_t color) {
+	return (color * 2654435761u) % COLOR_INDEX_SIZE;
+}
+
+void createPalette(struct sand_world* world) {
+	world->colors = (uint32_t*)malloc(sizeof(uint32_t)*MAX_ELEMENTS);
+	world->masks = (uint64_t*)calloc(MAX_ELEMENTS, sizeof(uint64_t));
+	world->color_index = (uint32_t*)calloc(COLOR_INDEX_SIZE, sizeof(uint32_t));
+	world->n_elements = 0;
+	pthread_mutex_init(&world->palette_lock, NULL);
+	intern(world, AIR); // AIR_ID
+}
+
+void destroyPalette(struct sand_world* world) {
+	free(world->colors);
+	free(world->masks);
+	free(world->color_index);
+	pthread_mutex_destroy(&world->palette_lock);
+}
+
+// Returns the element ID of 'color', adding it to the palette if it's new. Edit replacements intern
+// colors while chunks are swept in parallel, hence the lock
+uint16_t intern(struct sand_world* world, uint32_t color) {
+	pthread_mutex_lock(&world->palette_lock);
+	uint32_t h = colorHash(color);
+	while(world->color_index[h] != 0) {
+		uint32_t element = world->color_index[h] - 1;
+		if(world->colors[element] == color) {
+			pthread_mutex_unlock(&world->palette_lock);
+			return element;
+		}
+		h = (h + 1) % COLOR_INDEX_SIZE;
+	}
+	if(world->n_elements >= MAX_ELEMENTS) {
+		pthread_mutex_unlock(&world->palette_lock);
+		printf("\033[0;31mPalette is full, #%06x will be treated as air\033[0m\n", color & 0xffffff);
+		return AIR_ID;
+	}
+	uint32_t element = world->n_elements++;
+	world->colors[element] = color;
+	world->masks[element] = 0;
+	world->color_index[h] = element + 1;
+	pthread_mutex_unlock(&world->palette_lock);
+	return element;
+}
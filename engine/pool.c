@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "internal.h"
+
+// Work-stealing thread pool. poolRun() deals the tasks out over one deque per worker, every worker
+// pops from the bottom of its own deque and steals from the top of the others' once it runs dry.
+// The calling thread is worker 0, so a pool of 1 thread runs everything inline.
+
+struct deque {
+	pthread_mutex_t lock;
+	int* tasks;
+	int top, bottom;
+};
+
+struct worker {
+	struct pool* pool;
+	int index;
+	pthread_t thread;
+};
+
+struct pool {
+	int n_threads;
+	struct worker* workers;
+	struct deque* deques;
+	int capacity; // Tasks each deque can hold
+
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	uint32_t generation; // Bumped for every poolRun, wakes the workers
+	int busy; // Workers that haven't finished the current run
+	bool stop;
+
+	void (*run)(void* context, int task, int worker);
+	void* context;
+};
+
+static bool popTask(struct deque* d, int* task) {
+	bool found = false;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top) {
+		*task = d->tasks[--d->bottom];
+		found = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+static bool stealTask(struct deque* d, int* task) {
+	bool found = false;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top) {
+		*task = d->tasks[d->top++];
+		found = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// Run tasks until every deque is empty. No tasks are added during a run, so once a full round of
+// stealing comes up empty there's nothing left to do
+static void drain(struct pool* pool, int index) {
+	int task;
+	for(;;) {
+		if(popTask(pool->deques + index, &task)) {
+			pool->run(pool->context, task, index);
+			continue;
+		}
+		bool stolen = false;
+		for(int v = 1; v < pool->n_threads && !stolen; v++)
+			stolen = stealTask(pool->deques + (index + v) % pool->n_threads, &task);
+		if(!stolen)
+			return;
+		pool->run(pool->context, task, index);
+	}
+}
+
+static void* workerMain(void* arg) {
+	struct worker* worker = (struct worker*)arg;
+	struct pool* pool = worker->pool;
+	uint32_t seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	for(;;) {
+		while(pool->generation == seen && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if(pool->stop)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		drain(pool, worker->index);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct pool* createPool(int n_threads) {
+	if(n_threads < 1)
+		n_threads = 1;
+	struct pool* pool = (struct pool*)calloc(1, sizeof(struct pool));
+	pool->n_threads = n_threads;
+	pool->deques = (struct deque*)calloc(n_threads, sizeof(struct deque));
+	for(int i = 0; i < n_threads; i++)
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->workers = (struct worker*)calloc(n_threads, sizeof(struct worker));
+	for(int i = 1; i < n_threads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		pthread_create(&pool->workers[i].thread, NULL, workerMain, pool->workers + i);
+	}
+	return pool;
+}
+
+void destroyPool(struct pool* pool) {
+	if(pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i = 1; i < pool->n_threads; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	for(int i = 0; i < pool->n_threads; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->deques);
+	free(pool->workers);
+	free(pool);
+}
+
+int poolThreads(struct pool* pool) {
+	return pool->n_threads;
+}
+
+// Call run(context, task, worker) for every task in 0..n_tasks-1 and return once all of them are done
+void poolRun(struct pool* pool, int n_tasks, void (*run)(void* context, int task, int worker), void* context) {
+	if(n_tasks <= 0)
+		return;
+	if(pool->n_threads == 1 || n_tasks == 1) {
+		for(int t = 0; t < n_tasks; t++)
+			run(context, t, 0);
+		return;
+	}
+
+	int per_deque = (n_tasks + pool->n_threads - 1) / pool->n_threads;
+	if(per_deque > pool->capacity) {
+		pool->capacity = per_deque;
+		for(int i = 0; i < pool->n_threads; i++)
+			pool->deques[i].tasks = (int*)realloc(pool->deques[i].tasks, sizeof(int)*per_deque);
+	}
+	// Deal the tasks out in order, so neighboring tasks start on different workers
+	for(int i = 0; i < pool->n_threads; i++)
+		pool->deques[i].top = pool->deques[i].bottom = 0;
+	for(int t = n_tasks - 1; t >= 0; t--) {
+		struct deque* d = pool->deques + t % pool->n_threads;
+		d->tasks[d->bottom++] = t;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->run = run;
+	pool->context = context;
+	pool->busy = pool->n_threads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	drain(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
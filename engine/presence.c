@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// Element presence pyramid. The world is covered by TILE_SIZE tiles, each counting its cells per
+// identity and per element bit, so a tile's presence is always exact. Above the tiles sit levels of
+// blocks of 32, 128, 512... cells, up to a single block for the whole world, rebuilt from the tiles
+// under changed chunks at the end of every iteration. A rule whose needs aren't in an area's presence
+// can't fit anywhere in it.
+//
+// The sweep only reads tiles. The tiles around a chunk are only written by the thread sweeping it, so
+// what a sweep sees doesn't depend on the other threads. The levels are exact between iterations.
+
+void createPresence(struct sand_world* world) {
+	world->tiles_x = (world->width + TILE_SIZE - 1) / TILE_SIZE;
+	world->tiles_y = (world->height + TILE_SIZE - 1) / TILE_SIZE;
+	world->tiles = (struct tile*)calloc((size_t)world->tiles_x*world->tiles_y, sizeof(struct tile));
+
+	int size = CHUNK_SIZE;
+	world->n_levels = 0;
+	for(;;) {
+		struct level* level = world->levels + world->n_levels++;
+		level->size = size;
+		level->blocks_x = (world->width + size - 1) / size;
+		level->blocks_y = (world->height + size - 1) / size;
+		int n_blocks = level->blocks_x*level->blocks_y;
+		level->blocks = (struct presence*)calloc(n_blocks, sizeof(struct presence));
+		level->dirty = (bool*)calloc(n_blocks, sizeof(bool));
+		level->dirty_list = (int*)malloc(sizeof(int)*n_blocks);
+		level->n_dirty = 0;
+		if(n_blocks == 1)
+			break;
+		size *= 4;
+	}
+}
+
+void destroyPresence(struct sand_world* world) {
+	free(world->tiles);
+	for(int l = 0; l < world->n_levels; l++) {
+		free(world->levels[l].blocks);
+		free(world->levels[l].dirty);
+		free(world->levels[l].dirty_list);
+	}
+}
+
+static void countTile(struct tile* tile, uint16_t element, uint64_t mask, int delta) {
+	uint64_t identities = tile->presence.identities;
+	for(; mask; mask &= mask - 1) {
+		int i = __builtin_ctzll(mask);
+		tile->counts[i] += delta;
+		if(tile->counts[i] == 0)
+			identities &= ~((uint64_t)1 << i);
+		else
+			identities |= (uint64_t)1 << i;
+	}
+	tile->presence.identities = identities;
+	int e = elementSlot(element);
+	tile->counts[64 + e] += delta;
+	if(tile->counts[64 + e] == 0)
+		tile->presence.elements &= ~((uint64_t)1 << e);
+	else
+		tile->presence.elements |= (uint64_t)1 << e;
+}
+
+// A cell at (x, y) changed from 'from' to 'to'. A tile is only ever written by one thread at a time,
+// the chunks of a pass are further apart than a tile
+void presenceMove(struct sand_world* world, uint16_t from, uint16_t to, int x, int y) {
+	struct tile* tile = world->tiles + x / TILE_SIZE + (size_t)(y / TILE_SIZE)*world->tiles_x;
+	countTile(tile, from, world->masks[from], -1);
+	countTile(tile, to, world->masks[to], 1);
+}
+
+static void markDirty(struct level* level, int block) {
+	if(level->dirty[block])
+		return;
+	level->dirty[block] = true;
+	level->dirty_list[level->n_dirty++] = block;
+}
+
+// Mark the blocks over a chunk for rebuilding, the chunk is a block of the first level
+void presenceChanged(struct sand_world* world, int chunk) {
+	markDirty(world->levels, chunk);
+}
+
+// Rebuild the dirty blocks exactly, bottom up. Not thread safe, runs between sweeps
+void rebuildPresence(struct sand_world* world) {
+	for(int l = 0; l < world->n_levels; l++) {
+		struct level* level = world->levels + l;
+		for(int d = 0; d < level->n_dirty; d++) {
+			int b = level->dirty_list[d];
+			int bx = b % level->blocks_x, by = b / level->blocks_x;
+			struct presence presence = {0, 0};
+			if(l == 0) {
+				int per = CHUNK_SIZE / TILE_SIZE;
+				for(int ty = by*per; ty < (by+1)*per && ty < world->tiles_y; ty++)
+					for(int tx = bx*per; tx < (bx+1)*per && tx < world->tiles_x; tx++) {
+						presence.identities |= world->tiles[tx + (size_t)ty*world->tiles_x].presence.identities;
+						presence.elements |= world->tiles[tx + (size_t)ty*world->tiles_x].presence.elements;
+					}
+			} else {
+				struct level* below = level - 1;
+				for(int cy = by*4; cy < (by+1)*4 && cy < below->blocks_y; cy++)
+					for(int cx = bx*4; cx < (bx+1)*4 && cx < below->blocks_x; cx++) {
+						presence.identities |= below->blocks[cx + cy*below->blocks_x].identities;
+						presence.elements |= below->blocks[cx + cy*below->blocks_x].elements;
+					}
+			}
+			level->blocks[b] = presence;
+			level->dirty[b] = false;
+			if(l + 1 < world->n_levels)
+				markDirty(level + 1, bx / 4 + (by / 4)*(level + 1)->blocks_x);
+		}
+		level->n_dirty = 0;
+	}
+}
+
+// Recount every tile and rebuild every block. Needed when the identity masks change, that is when rules load
+void recountPresence(struct sand_world* world) {
+	memset(world->tiles, 0, sizeof(struct tile)*world->tiles_x*world->tiles_y);
+	for(int j = 0; j < world->height; j++)
+		for(int i = 0; i < world->width; i++) {
+			uint16_t element = get(world, i, j);
+			countTile(world->tiles + i / TILE_SIZE + (size_t)(j / TILE_SIZE)*world->tiles_x, element, world->masks[element], 1);
+		}
+	for(int c = 0; c < world->chunks_x*world->chunks_y; c++)
+		markDirty(world->levels, c);
+	rebuildPresence(world);
+}
+
+// Clamp a rectangle to the world. Cells outside it are left out of presences, no match but a wildcard accepts them
+static bool clampArea(struct sand_world* world, int* left, int* top, int* right, int* bottom) {
+	*left = *left < 0 ? 0 : *left;
+	*top = *top < 0 ? 0 : *top;
+	*right = *right >= world->width ? world->width - 1 : *right;
+	*bottom = *bottom >= world->height ? world->height - 1 : *bottom;
+	return *left <= *right && *top <= *bottom;
+}
+
+// Presence of the cells of the rectangle from the tiles, exact at any time
+struct presence tilePresence(struct sand_world* world, int left, int top, int right, int bottom) {
+	struct presence presence = {0, 0};
+	if(!clampArea(world, &left, &top, &right, &bottom))
+		return presence;
+	for(int ty = top / TILE_SIZE; ty <= bottom / TILE_SIZE; ty++)
+		for(int tx = left / TILE_SIZE; tx <= right / TILE_SIZE; tx++) {
+			presence.identities |= world->tiles[tx + (size_t)ty*world->tiles_x].presence.identities;
+			presence.elements |= world->tiles[tx + (size_t)ty*world->tiles_x].presence.elements;
+		}
+	return presence;
+}
+
+// Presence of the cells of the rectangle, from the smallest level whose blocks it spans at most two of
+// in each direction. Only exact between iterations, during a sweep use tilePresence
+struct presence presenceOf(struct sand_world* world, int left, int top, int right, int bottom) {
+	struct presence presence = {0, 0};
+	if(!clampArea(world, &left, &top, &right, &bottom))
+		return presence;
+	if(right / TILE_SIZE - left / TILE_SIZE <= 1 && bottom / TILE_SIZE - top / TILE_SIZE <= 1)
+		return tilePresence(world, left, top, right, bottom);
+	for(int l = 0; l < world->n_levels; l++) {
+		struct level* level = world->levels + l;
+		if(right / level->size - left / level->size > 1 || bottom / level->size - top / level->size > 1)
+			continue;
+		for(int by = top / level->size; by <= bottom / level->size; by++)
+			for(int bx = left / level->size; bx <= right / level->size; bx++) {
+				presence.identities |= level->blocks[bx + by*level->blocks_x].identities;
+				presence.elements |= level->blocks[bx + by*level->blocks_x].elements;
+			}
+		return presence;
+	}
+	return presence; // The last level is a single block, so it always returns above
+}
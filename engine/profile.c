@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "internal.h"
+
+// Where the sweep's time goes, in builds with SAND_PROFILE ('make profile'). Each pool worker counts into
+// its own block of rule counters, so the sweep shares nothing more than it did and the counts are only
+// summed for a report. Cells count their own writes in put(): within a pass no two threads write the same
+// cell, so those need no atomics either. Without SAND_PROFILE none of this is built in and the API is stubs
+
+#ifdef SAND_PROFILE
+
+// Blocks for every worker the pool might run, the serial pool runs as worker 0
+static int profileWorkers(struct sand_world* world) {
+	int workers = poolThreads(world->pool);
+	return workers > 1 ? workers : 1;
+}
+
+void createProfile(struct sand_world* world) {
+	world->profile_workers = profileWorkers(world);
+	world->profile = (struct rule_profile*)calloc((size_t)world->profile_workers*MAX_RULES, sizeof(struct rule_profile));
+	world->heat = (uint32_t*)calloc((size_t)world->width*world->height, sizeof(uint32_t));
+}
+
+void destroyProfile(struct sand_world* world) {
+	free(world->profile);
+	free(world->heat);
+}
+
+static void addProfile(struct rule_profile* to, const struct rule_profile* from) {
+	to->offered += from->offered;
+	to->chance += from->chance;
+	to->misses += from->misses;
+	to->potential += from->potential;
+	to->matches += from->matches;
+	to->cycles += from->cycles;
+}
+
+// Every worker's counts summed
+static void totalProfile(struct sand_world* world, struct rule_profile* totals) {
+	memset(totals, 0, sizeof(struct rule_profile)*MAX_RULES);
+	for(int w = 0; w < world->profile_workers; w++)
+		for(int r = 0; r < MAX_RULES; r++)
+			addProfile(totals + r, world->profile + (size_t)w*MAX_RULES + r);
+}
+
+// After the pool was replaced. The counts so far carry over in worker 0's block
+void resizeProfile(struct sand_world* world) {
+	int workers = profileWorkers(world);
+	if(workers == world->profile_workers)
+		return;
+	struct rule_profile* profile = (struct rule_profile*)calloc((size_t)workers*MAX_RULES, sizeof(struct rule_profile));
+	totalProfile(world, profile);
+	free(world->profile);
+	world->profile = profile;
+	world->profile_workers = workers;
+}
+
+struct ranked {
+	int rule;
+	struct rule_profile counts;
+};
+
+static int costlier(const void* a, const void* b) {
+	uint64_t ca = ((const struct ranked*)a)->counts.cycles, cb = ((const struct ranked*)b)->counts.cycles;
+	return ca < cb ? 1 : ca > cb ? -1 : ((const struct ranked*)a)->rule - ((const struct ranked*)b)->rule;
+}
+
+bool sandPrintProfile(struct sand_world* world) {
+	struct rule_profile totals[MAX_RULES];
+	totalProfile(world, totals);
+	struct ranked ranked[MAX_RULES];
+	int n_ranked = 0;
+	uint64_t cycles = 0, offered = 0;
+	for(int r = 0; r < world->n_rules; r++) {
+		cycles += totals[r].cycles;
+		offered += totals[r].offered;
+		if(totals[r].offered > 0)
+			ranked[n_ranked++] = (struct ranked){r, totals[r]};
+	}
+	qsort(ranked, n_ranked, sizeof(struct ranked), costlier);
+
+	printf("Rules by time spent, %llu offers in %llu cycles. Offers turned down by chance, by potential, by\n", (unsigned long long)offered, (unsigned long long)cycles);
+	printf("their cells, and matched (and enforced):\n");
+	printf("%6s %10s %12s %12s %12s %12s %12s  %s\n", "time", "per offer", "offered", "chance", "potential", "cells", "matched", "rule");
+	for(int k = 0; k < n_ranked; k++) {
+		const struct rule_profile* p = &ranked[k].counts;
+		const char* origin = world->rules[ranked[k].rule].origin;
+		printf("%5.1f%% %10.1f %12llu %12llu %12llu %12llu %12llu  %s\n", cycles > 0 ? 100.0*p->cycles/cycles : 0.0,
+			(double)p->cycles/p->offered, (unsigned long long)p->offered, (unsigned long long)p->chance,
+			(unsigned long long)p->potential, (unsigned long long)(p->misses - p->potential),
+			(unsigned long long)p->matches, origin[0] != '\0' ? origin : "(unnamed)");
+	}
+	return true;
+}
+
+void sandResetProfile(struct sand_world* world) {
+	memset(world->profile, 0, sizeof(struct rule_profile)*world->profile_workers*MAX_RULES);
+	memset(world->heat, 0, sizeof(uint32_t)*world->width*world->height);
+}
+
+bool sandRenderHeat(struct sand_world* world, uint32_t* pixels, int pitch) {
+	size_t n_cells = (size_t)world->width*world->height;
+	uint32_t most = 0;
+	for(size_t i = 0; i < n_cells; i++)
+		most = world->heat[i] > most ? world->heat[i] : most;
+	// Log scale, so the rest of the world still shows next to the few cells that never settle
+	float scale = most > 0 ? 1.0f / log1pf((float)most) : 0.0f;
+	for(int j = 0; j < world->height; j++) {
+		uint32_t* row = (uint32_t*)((uint8_t*)pixels + (size_t)j*pitch);
+		const uint32_t* heat = world->heat + (size_t)j*world->width;
+		for(int i = 0; i < world->width; i++) {
+			if(heat[i] == 0) {
+				row[i] = 0;
+				continue;
+			}
+			// Translucent red for the odd write up to opaque yellow for the most
+			float t = log1pf((float)heat[i]) * scale;
+			row[i] = (uint32_t)(64 + 191*t) << 24 | 255 << 16 | (uint32_t)(255*t) << 8;
+		}
+	}
+	return true;
+}
+
+#else
+
+void createProfile(struct sand_world* world) {
+}
+
+void destroyProfile(struct sand_world* world) {
+}
+
+void resizeProfile(struct sand_world* world) {
+}
+
+bool sandPrintProfile(struct sand_world* world) {
+	return false;
+}
+
+void sandResetProfile(struct sand_world* world) {
+}
+
+bool sandRenderHeat(struct sand_world* world, uint32_t* pixels, int pitch) {
+	return false;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include "internal.h"
+
+// Rule programs. Every rule's match block is compiled into the list of its non-wildcard cells, as
+// offsets into the grid, with the cells that accept the fewest elements first so a position that doesn't
+// fit usually fails on the first load. Non-wildcard cells never fit out of bounds, so the box around
+// them bounds the positions the rule can fit at.
+
+static int compareChecks(const void* a, const void* b) {
+	const struct check* ca = (const struct check*)a;
+	const struct check* cb = (const struct check*)b;
+	if(ca->accepted != cb->accepted)
+		return ca->accepted - cb->accepted;
+	return ca->type - cb->type; // Exact elements before identities
+}
+
+static void growBox(struct box* box, int x, int y) {
+	box->left = x < box->left ? x : box->left;
+	box->right = x > box->right ? x : box->right;
+	box->top = y < box->top ? y : box->top;
+	box->bottom = y > box->bottom ? y : box->bottom;
+}
+
+static void compileRule(struct sand_world* world, struct rule* rule) {
+	struct box empty = {4, 0, 4, 0};
+	rule->footprint = empty;
+	rule->n_checks = 0;
+	struct check anchor;
+	bool has_anchor = false;
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; i < 5; i++) {
+			struct match_t match = rule->match[j][i];
+			if(match.type == -1)
+				continue;
+			growBox(&rule->footprint, i, j);
+			struct check check = {i + j*world->width, j*5+i, match.type, acceptedCount(world, match), match.value};
+			// The dispatch already checked the anchor, so it only needs checking if everything else fits
+			if(j*5+i == rule->anchor) {
+				anchor = check;
+				has_anchor = true;
+			} else
+				rule->program[rule->n_checks++] = check;
+		}
+	qsort(rule->program, rule->n_checks, sizeof(struct check), compareChecks);
+	if(has_anchor)
+		rule->program[rule->n_checks++] = anchor;
+}
+
+// Compile every rule, and find the positions any rule can fit at. Run after chooseAnchors
+void compileRules(struct sand_world* world) {
+	world->sweep_left = world->width;
+	world->sweep_right = -4;
+	world->sweep_top = world->height;
+	world->sweep_bottom = -4;
+	for(int r = 0; r < world->n_rules; r++) {
+		struct rule* rule = world->rules + r;
+		compileRule(world, rule);
+		// A rule of only wildcards fits anywhere its window overlaps the world
+		int left = -4, right = world->width - 1, top = -4, bottom = world->height - 1;
+		if(rule->n_checks > 0) {
+			left = -rule->footprint.left;
+			right = world->width - 1 - rule->footprint.right;
+			top = -rule->footprint.top;
+			bottom = world->height - 1 - rule->footprint.bottom;
+		}
+		world->sweep_left = left < world->sweep_left ? left : world->sweep_left;
+		world->sweep_right = right > world->sweep_right ? right : world->sweep_right;
+		world->sweep_top = top < world->sweep_top ? top : world->sweep_top;
+		world->sweep_bottom = bottom > world->sweep_bottom ? bottom : world->sweep_bottom;
+	}
+}
@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "internal.h"
+
+// Recordings of a run, see sandRecord, and playing them back, see sandOpenReplay. A recording is a
+// keyframe of the whole world, then a frame per step with just the cells the step changed, with another
+// keyframe every so many steps to seek to.
+//
+// Recording adds nothing to put(): the chunks a step changes are already flagged for sleeping (see touch),
+// updateChunks passes the flags on to the recording before clearing them, and at the end of the step only
+// the flagged chunks are compared with a copy of the world as of the last frame. Frames are handed to a
+// writer thread in blocks, the step never waits on the disk.
+//
+// Layout, in the host's byte order: the header, then frames of a frame_header and its data. All numbers in
+// the data are varints, except colors:
+//   KEYFRAME  n_colors, colors[n_colors], then runs of (length - 1, element) over the world row by row
+//   DELTA     n_new, the colors added to the palette since the last frame, n_chunks, then for each changed
+//             chunk its index and spans of (cells skipped, length, element) over its cells row by row. A
+//             span of length 0, without an element, ends the chunk
+
+#define RECORDING_MAGIC 0x44434552444e4153ull // "SANDRECD"
+#define RECORDING_VERSION 1
+#define BLOCK_SIZE (1 << 20) // Bytes of frames gathered before they're handed to the writer
+
+struct recording_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t chunk_size;
+};
+
+enum {
+	KEYFRAME,
+	DELTA
+};
+
+struct frame_header {
+	uint32_t type;
+	uint32_t size; // Of the data after the header
+};
+
+struct block {
+	uint8_t* data;
+	size_t size;
+	struct block* next;
+};
+
+struct recording {
+	char* path;
+	FILE* file;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	// Blocks waiting for the writer, and whether it should stop once they're written. Under the lock
+	struct block* queue;
+	struct block** tail;
+	bool stop;
+	bool failed; // Only the writer sets it, read after it's joined
+
+	// Frames not handed over yet
+	uint8_t* data;
+	size_t size, capacity;
+	uint16_t* shadow; // The world as of the last frame
+	int* dirty; // Chunks changed since the last frame
+	int n_dirty;
+	bool* listed; // In 'dirty'
+	bool everything; // The cells were replaced wholesale, the next frame is a keyframe
+	uint32_t n_colors; // Palette entries as of the last frame
+	int keyframe_every;
+	int frames;
+};
+
+static void* writerThread(void* data) {
+	struct recording* recording = (struct recording*)data;
+	pthread_mutex_lock(&recording->lock);
+	for(;;) {
+		while(recording->queue == NULL && !recording->stop)
+			pthread_cond_wait(&recording->wake, &recording->lock);
+		struct block* block = recording->queue;
+		if(block == NULL)
+			break;
+		recording->queue = block->next;
+		if(recording->queue == NULL)
+			recording->tail = &recording->queue;
+		pthread_mutex_unlock(&recording->lock);
+		if(!recording->failed && fwrite(block->data, 1, block->size, recording->file) != block->size)
+			recording->failed = true;
+		free(block->data);
+		free(block);
+		pthread_mutex_lock(&recording->lock);
+	}
+	pthread_mutex_unlock(&recording->lock);
+	return NULL;
+}
+
+static void handOver(struct recording* recording) {
+	if(recording->size == 0)
+		return;
+	struct block* block = (struct block*)malloc(sizeof(struct block));
+	block->data = recording->data;
+	block->size = recording->size;
+	block->next = NULL;
+	pthread_mutex_lock(&recording->lock);
+	*recording->tail = block;
+	recording->tail = &block->next;
+	pthread_cond_signal(&recording->wake);
+	pthread_mutex_unlock(&recording->lock);
+	recording->capacity = BLOCK_SIZE;
+	recording->data = (uint8_t*)malloc(recording->capacity);
+	recording->size = 0;
+}
+
+static void reserve(struct recording* recording, size_t bytes) {
+	if(recording->size + bytes <= recording->capacity)
+		return;
+	while(recording->size + bytes > recording->capacity)
+		recording->capacity *= 2;
+	recording->data = (uint8_t*)realloc(recording->data, recording->capacity);
+}
+
+static void putNumber(struct recording* recording, uint32_t value) {
+	reserve(recording, 5);
+	recording->size += putVarint(recording->data + recording->size, value);
+}
+
+static void putColors(struct recording* recording, const uint32_t* colors, uint32_t n) {
+	reserve(recording, sizeof(uint32_t)*n);
+	memcpy(recording->data + recording->size, colors, sizeof(uint32_t)*n);
+	recording->size += sizeof(uint32_t)*n;
+}
+
+static size_t beginFrame(struct recording* recording, uint32_t type) {
+	reserve(recording, sizeof(struct frame_header));
+	size_t at = recording->size;
+	recording->size += sizeof(struct frame_header);
+	memcpy(recording->data + at, &type, sizeof(type));
+	return at;
+}
+
+static void endFrame(struct recording* recording, size_t at) {
+	uint32_t size = recording->size - at - sizeof(struct frame_header);
+	memcpy(recording->data + at + offsetof(struct frame_header, size), &size, sizeof(size));
+	recording->frames++;
+	if(recording->size >= BLOCK_SIZE)
+		handOver(recording);
+}
+
+static void writeKeyframe(struct sand_world* world, struct recording* recording) {
+	size_t at = beginFrame(recording, KEYFRAME);
+	putNumber(recording, world->n_elements);
+	putColors(recording, world->colors, world->n_elements);
+	size_t n_cells = (size_t)world->width*world->height;
+	const uint16_t* cells = world->cells;
+	for(size_t i = 0; i < n_cells;) {
+		size_t run = 1;
+		while(i + run < n_cells && run < 0x80000000u && cells[i + run] == cells[i])
+			run++;
+		putNumber(recording, run - 1);
+		putNumber(recording, cells[i]);
+		i += run;
+	}
+	endFrame(recording, at);
+	memcpy(recording->shadow, world->cells, sizeof(uint16_t)*n_cells);
+	recording->n_colors = world->n_elements;
+	for(int d = 0; d < recording->n_dirty; d++)
+		recording->listed[recording->dirty[d]] = false;
+	recording->n_dirty = 0;
+	recording->everything = false;
+}
+
+static void putSpan(struct recording* recording, uint32_t skip, uint32_t length, uint16_t element) {
+	putNumber(recording, skip);
+	putNumber(recording, length);
+	putNumber(recording, element);
+}
+
+static void writeDelta(struct sand_world* world, struct recording* recording) {
+	size_t at = beginFrame(recording, DELTA);
+	putNumber(recording, world->n_elements - recording->n_colors);
+	putColors(recording, world->colors + recording->n_colors, world->n_elements - recording->n_colors);
+	recording->n_colors = world->n_elements;
+	putNumber(recording, recording->n_dirty);
+	for(int d = 0; d < recording->n_dirty; d++) {
+		int c = recording->dirty[d];
+		recording->listed[c] = false;
+		putNumber(recording, c);
+		int left = c % world->chunks_x * CHUNK_SIZE, top = c / world->chunks_x * CHUNK_SIZE;
+		int right = left + CHUNK_SIZE < world->width ? left + CHUNK_SIZE : world->width;
+		int bottom = top + CHUNK_SIZE < world->height ? top + CHUNK_SIZE : world->height;
+		uint32_t skip = 0, length = 0;
+		uint16_t element = 0;
+		for(int y = top; y < bottom; y++)
+			for(int x = left; x < right; x++) {
+				size_t index = x + (size_t)y*world->width;
+				uint16_t now = world->cells[index];
+				if(now == recording->shadow[index]) {
+					if(length > 0) {
+						putSpan(recording, skip, length, element);
+						skip = length = 0;
+					}
+					skip++;
+					continue;
+				}
+				recording->shadow[index] = now;
+				if(length > 0 && now == element)
+					length++;
+				else {
+					if(length > 0) {
+						putSpan(recording, skip, length, element);
+						skip = 0;
+					}
+					element = now;
+					length = 1;
+				}
+			}
+		if(length > 0)
+			putSpan(recording, skip, length, element);
+		putNumber(recording, 0);
+		putNumber(recording, 0);
+	}
+	recording->n_dirty = 0;
+	endFrame(recording, at);
+}
+
+// The chunk changed this iteration. Called by updateChunks
+void recordChanged(struct sand_world* world, int chunk) {
+	struct recording* recording = world->recording;
+	if(!recording->listed[chunk]) {
+		recording->listed[chunk] = true;
+		recording->dirty[recording->n_dirty++] = chunk;
+	}
+}
+
+// Every cell may have changed, without the chunks knowing
+void recordEverything(struct sand_world* world) {
+	world->recording->everything = true;
+}
+
+// Adds the frame of the step that just ended
+void recordStep(struct sand_world* world) {
+	struct recording* recording = world->recording;
+	if(recording->everything || recording->frames % recording->keyframe_every == 0)
+		writeKeyframe(world, recording);
+	else
+		writeDelta(world, recording);
+}
+
+bool sandRecord(struct sand_world* world, const char* path, int keyframe_every) {
+	sandStopRecording(world);
+	FILE* f = fopen(path, "wb");
+	if(f == NULL) {
+		printf("\033[0;31mCouldn't open \"%s\" for recording\033[0m\n", path);
+		return false;
+	}
+	struct recording* recording = (struct recording*)calloc(1, sizeof(struct recording));
+	recording->path = (char*)malloc(strlen(path) + 1);
+	strcpy(recording->path, path);
+	recording->file = f;
+	pthread_mutex_init(&recording->lock, NULL);
+	pthread_cond_init(&recording->wake, NULL);
+	recording->tail = &recording->queue;
+	recording->capacity = BLOCK_SIZE;
+	recording->data = (uint8_t*)malloc(recording->capacity);
+	recording->shadow = (uint16_t*)malloc(sizeof(uint16_t)*world->width*world->height);
+	int n_chunks = world->chunks_x*world->chunks_y;
+	recording->dirty = (int*)malloc(sizeof(int)*n_chunks);
+	recording->listed = (bool*)calloc(n_chunks, sizeof(bool));
+	recording->keyframe_every = keyframe_every > 0 ? keyframe_every : 1;
+	if(pthread_create(&recording->thread, NULL, writerThread, recording) != 0) {
+		printf("\033[0;31mCouldn't start recording to \"%s\"\033[0m\n", path);
+		fclose(f);
+		pthread_cond_destroy(&recording->wake);
+		pthread_mutex_destroy(&recording->lock);
+		free(recording->data);
+		free(recording->shadow);
+		free(recording->dirty);
+		free(recording->listed);
+		free(recording->path);
+		free(recording);
+		return false;
+	}
+
+	struct recording_header header = {RECORDING_MAGIC, RECORDING_VERSION, world->width, world->height, CHUNK_SIZE};
+	reserve(recording, sizeof(header));
+	memcpy(recording->data, &header, sizeof(header));
+	recording->size = sizeof(header);
+	writeKeyframe(world, recording);
+	world->recording = recording;
+	return true;
+}
+
+bool sandStopRecording(struct sand_world* world) {
+	struct recording* recording = world->recording;
+	if(recording == NULL)
+		return true;
+	handOver(recording);
+	pthread_mutex_lock(&recording->lock);
+	recording->stop = true;
+	pthread_cond_signal(&recording->wake);
+	pthread_mutex_unlock(&recording->lock);
+	pthread_join(recording->thread, NULL);
+	bool written = fclose(recording->file) == 0 && !recording->failed;
+	if(!written)
+		printf("\033[0;31mCouldn't write the recording \"%s\"\033[0m\n", recording->path);
+	pthread_cond_destroy(&recording->wake);
+	pthread_mutex_destroy(&recording->lock);
+	free(recording->data);
+	free(recording->shadow);
+	free(recording->dirty);
+	free(recording->listed);
+	free(recording->path);
+	free(recording);
+	world->recording = NULL;
+	return written;
+}
+
+struct sand_replay {
+	const uint8_t* data;
+	size_t size;
+	int width, height;
+	int chunk_size, chunks_x, chunks_y;
+	size_t* frames; // Offset of each frame's header
+	int n_frames;
+	int* keyframes; // Frames that are keyframes, in order
+	int n_keyframes;
+	int frame; // Shown in 'cells'
+	uint16_t* cells;
+	uint32_t* colors;
+	uint32_t n_colors;
+};
+
+static bool applyKeyframe(struct sand_replay* replay, const uint8_t* at, const uint8_t* end) {
+	uint32_t n_colors;
+	if(!getVarint(&at, end, &n_colors) || n_colors < 1 || n_colors > MAX_ELEMENTS || (size_t)(end - at) < sizeof(uint32_t)*n_colors)
+		return false;
+	memcpy(replay->colors, at, sizeof(uint32_t)*n_colors);
+	replay->n_colors = n_colors;
+	at += sizeof(uint32_t)*n_colors;
+	size_t n_cells = (size_t)replay->width*replay->height;
+	for(size_t i = 0; i < n_cells;) {
+		uint32_t run, element;
+		if(!getVarint(&at, end, &run) || !getVarint(&at, end, &element) || element >= n_colors || run >= n_cells - i)
+			return false;
+		for(run++; run > 0; run--)
+			replay->cells[i++] = element;
+	}
+	return at == end;
+}
+
+static bool applyDelta(struct sand_replay* replay, const uint8_t* at, const uint8_t* end) {
+	uint32_t n_new, n_chunks;
+	if(!getVarint(&at, end, &n_new) || n_new > MAX_ELEMENTS - replay->n_colors || (size_t)(end - at) < sizeof(uint32_t)*n_new)
+		return false;
+	memcpy(replay->colors + replay->n_colors, at, sizeof(uint32_t)*n_new);
+	replay->n_colors += n_new;
+	at += sizeof(uint32_t)*n_new;
+	if(!getVarint(&at, end, &n_chunks))
+		return false;
+	for(uint32_t n = 0; n < n_chunks; n++) {
+		uint32_t c;
+		if(!getVarint(&at, end, &c) || c >= (uint32_t)(replay->chunks_x*replay->chunks_y))
+			return false;
+		int left = c % replay->chunks_x * replay->chunk_size, top = c / replay->chunks_x * replay->chunk_size;
+		int columns = left + replay->chunk_size < replay->width ? replay->chunk_size : replay->width - left;
+		int rows = top + replay->chunk_size < replay->height ? replay->chunk_size : replay->height - top;
+		uint32_t n_cells = columns*rows, k = 0;
+		for(;;) {
+			uint32_t skip, length, element;
+			if(!getVarint(&at, end, &skip) || !getVarint(&at, end, &length))
+				return false;
+			if(length == 0)
+				break;
+			if(!getVarint(&at, end, &element) || element >= replay->n_colors || skip > n_cells - k || length > n_cells - k - skip)
+				return false;
+			for(k += skip; length > 0; length--, k++)
+				replay->cells[left + k % columns + (size_t)(top + k / columns)*replay->width] = element;
+		}
+	}
+	return at == end;
+}
+
+// Brings frame 'f' into the cells, from the frame before it unless it's a keyframe. A frame that doesn't
+// decode ends the recording there
+static bool applyFrame(struct sand_replay* replay, int f) {
+	struct frame_header header;
+	memcpy(&header, replay->data + replay->frames[f], sizeof(header));
+	const uint8_t* at = replay->data + replay->frames[f] + sizeof(header);
+	bool applied = header.type == KEYFRAME ? applyKeyframe(replay, at, at + header.size) : applyDelta(replay, at, at + header.size);
+	if(!applied) {
+		printf("\033[0;31mFrame %d of the recording is damaged, it ends at frame %d\033[0m\n", f, f - 1);
+		replay->n_frames = f;
+		while(replay->n_keyframes > 0 && replay->keyframes[replay->n_keyframes - 1] >= f)
+			replay->n_keyframes--;
+	}
+	return applied;
+}
+
+struct sand_replay* sandOpenReplay(const char* path) {
+	size_t size;
+	const uint8_t* data = mapFile(path, &size);
+	if(data == NULL) {
+		printf("\033[0;31mCouldn't open the recording \"%s\"\033[0m\n", path);
+		return NULL;
+	}
+	struct recording_header header;
+	if(size >= sizeof(header))
+		memcpy(&header, data, sizeof(header));
+	if(size < sizeof(header) || header.magic != RECORDING_MAGIC || header.version != RECORDING_VERSION || header.width < 1
+		|| header.height < 1 || header.width > 65536 || header.height > 65536 || header.chunk_size < 1 || header.chunk_size > 4096) {
+		printf("\033[0;31m\"%s\" isn't a recording\033[0m\n", path);
+		unmapFile(data, size);
+		return NULL;
+	}
+	struct sand_replay* replay = (struct sand_replay*)calloc(1, sizeof(struct sand_replay));
+	replay->data = data;
+	replay->size = size;
+	replay->width = header.width;
+	replay->height = header.height;
+	replay->chunk_size = header.chunk_size;
+	replay->chunks_x = (header.width + header.chunk_size - 1) / header.chunk_size;
+	replay->chunks_y = (header.height + header.chunk_size - 1) / header.chunk_size;
+
+	// Index the frames. A recording that was cut off, by a crash or because it's still being written,
+	// plays up to its last whole frame
+	int capacity = 1024;
+	replay->frames = (size_t*)malloc(sizeof(size_t)*capacity);
+	replay->keyframes = (int*)malloc(sizeof(int)*capacity);
+	for(size_t at = sizeof(header); size - at >= sizeof(struct frame_header);) {
+		struct frame_header frame;
+		memcpy(&frame, data + at, sizeof(frame));
+		if(frame.size > size - at - sizeof(frame) || (frame.type != KEYFRAME && frame.type != DELTA) || (replay->n_frames == 0 && frame.type != KEYFRAME))
+			break;
+		if(replay->n_frames == capacity) {
+			capacity *= 2;
+			replay->frames = (size_t*)realloc(replay->frames, sizeof(size_t)*capacity);
+			replay->keyframes = (int*)realloc(replay->keyframes, sizeof(int)*capacity);
+		}
+		if(frame.type == KEYFRAME)
+			replay->keyframes[replay->n_keyframes++] = replay->n_frames;
+		replay->frames[replay->n_frames++] = at;
+		at += sizeof(frame) + frame.size;
+	}
+
+	replay->cells = (uint16_t*)malloc(sizeof(uint16_t)*replay->width*replay->height);
+	replay->colors = (uint32_t*)malloc(sizeof(uint32_t)*MAX_ELEMENTS);
+	if(replay->n_frames == 0 || !applyFrame(replay, 0)) {
+		printf("\033[0;31mThe recording \"%s\" has no frames\033[0m\n", path);
+		sandCloseReplay(replay);
+		return NULL;
+	}
+	return replay;
+}
+
+void sandCloseReplay(struct sand_replay* replay) {
+	if(replay == NULL)
+		return;
+	unmapFile(replay->data, replay->size);
+	free(replay->frames);
+	free(replay->keyframes);
+	free(replay->cells);
+	free(replay->colors);
+	free(replay);
+}
+
+int sandSeekReplay(struct sand_replay* replay, int frame) {
+	if(frame >= replay->n_frames)
+		frame = replay->n_frames - 1;
+	if(frame < 0)
+		frame = 0;
+	// The last keyframe at or before the frame, unless the frames after the current one get there sooner
+	int low = 0, high = replay->n_keyframes - 1;
+	while(low < high) {
+		int middle = (low + high + 1) / 2;
+		if(replay->keyframes[middle] <= frame)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	int keyframe = replay->keyframes[low];
+	if(replay->frame > frame || replay->frame < keyframe) {
+		if(!applyFrame(replay, keyframe))
+			return replay->frame; // Unreachable for the first keyframe, it decoded on opening
+		replay->frame = keyframe;
+	}
+	while(replay->frame < frame && replay->frame + 1 < replay->n_frames && applyFrame(replay, replay->frame + 1))
+		replay->frame++;
+	return replay->frame;
+}
+
+int sandReplayFrame(struct sand_replay* replay) {
+	return replay->frame;
+}
+
+int sandReplayFrames(struct sand_replay* replay) {
+	return replay->n_frames;
+}
+
+int sandReplayWidth(struct sand_replay* replay) {
+	return replay->width;
+}
+
+int sandReplayHeight(struct sand_replay* replay) {
+	return replay->height;
+}
+
+uint32_t sandReplayGet(struct sand_replay* replay, int x, int y) {
+	if(x < 0 || x >= replay->width || y < 0 || y >= replay->height)
+		return SAND_AIR;
+	return replay->colors[replay->cells[x + (size_t)y*replay->width]];
+}
+
+void sandRenderReplay(struct sand_replay* replay, uint32_t* pixels, int pitch) {
+	for(int j = 0; j < replay->height; j++) {
+		uint32_t* row = (uint32_t*)((uint8_t*)pixels + (size_t)j*pitch);
+		const uint16_t* cells = replay->cells + (size_t)j*replay->width;
+		for(int i = 0; i < replay->width; i++)
+			row[i] = replay->colors[cells[i]];
+	}
+}
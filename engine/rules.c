@@ -0,0 +1,728 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include "internal.h"
+
+// Ruleset files are read in a single pass over the file, by hand. Every line is blank, an element, one of
+// the identities of the element above it, a symbol definition, or "rule:" followed by the five rows of a
+// rule. A file is parsed whole before any of it reaches the world, so a malformed file is reported and
+// left out, with nothing of it loaded.
+
+bool matchCmp(const struct match_t a, const struct match_t b) {
+	if(a.type!=b.type)
+		return false;
+	if(a.type==-1)
+		return true;
+	return a.value == b.value;
+}
+
+// Index of the identity named by the 'length' characters at 'name', -1 if there's none
+int findIdentity(struct sand_world* world, const char* name, int length) {
+	for(int i = 0; i < world->n_identities; i++)
+		if(world->identities[i].name != NULL && strncmp(world->identities[i].name, name, length) == 0 && world->identities[i].name[length] == '\0')
+			return i;
+	return -1;
+}
+
+bool isIdentity(struct sand_world* world, const uint32_t identity_index, uint16_t element) {
+	if(identity_index < 0 || identity_index >= world->n_identities)
+		return false;
+	return (world->masks[element] >> identity_index) & 1;
+}
+
+// Adds an identity without members. There must be a bit left for it in the element masks
+static int addIdentity(struct sand_world* world, const char* name, int length) {
+	world->identities = realloc(world->identities, sizeof(struct identity)*(world->n_identities+1));
+	char* copy = (char*)malloc(length + 1);
+	memcpy(copy, name, length);
+	copy[length] = '\0';
+	world->identities[world->n_identities].member_count = 0;
+	world->identities[world->n_identities].members = NULL;
+	world->identities[world->n_identities].name = copy;
+	return world->n_identities++;
+}
+
+bool isMatchMemberOf(struct match_t val, struct match_t* list, uint32_t max) {
+	for(int i = 0; i < max; i++)
+		if(matchCmp(list[i],val))
+			return true;
+	return false;
+}
+
+// Works out what a rule's match block and chance imply. A mirrored rule shares its original's search_for
+void finishRule(struct rule* rule, const struct rule* original) {
+	if(original != NULL) {
+		rule->search_for = original->search_for;
+		rule->num_search_for = original->num_search_for;
+		rule->needs = original->needs;
+	} else {
+		rule->search_for = (struct match_t*)malloc(sizeof(struct match_t)*5*5);
+		rule->num_search_for = 0;
+		for(int i = 0; i < 5; i++)
+			for(int j = 0; j < 5; j++)
+				if(!isMatchMemberOf(rule->match[i][j], rule->search_for, rule->num_search_for))
+					rule->search_for[rule->num_search_for++] = rule->match[i][j];
+		rule->needs.identities = rule->needs.elements = 0;
+		for(int i = 0; i < rule->num_search_for; i++) {
+			if(rule->search_for[i].type == 0)
+				rule->needs.elements |= (uint64_t)1 << elementSlot(rule->search_for[i].value);
+			if(rule->search_for[i].type == 1)
+				rule->needs.identities |= (uint64_t)1 << rule->search_for[i].value;
+		}
+	}
+	rule->threshold = rule->chance >= 1 ? UINT32_MAX : rule->chance <= 0 ? 0 : (uint32_t)(rule->chance * 4294967296.0);
+	rule->log_fail = rule->chance > 0 && rule->chance < 1 ? log(1 - (double)rule->chance) : 0;
+	rule->compiled = NULL;
+}
+
+struct span {
+	const char* text;
+	int length;
+};
+
+// A term of a rule as written, before its colors and identities are looked up
+struct term {
+	int8_t type; // match_t's types in the match block, replace_t's in the replace block
+	uint32_t value; // Color for type 0, the packed edit for an edit
+	int8_t refX, refY;
+	struct span name; // Of the identity, for identity terms
+};
+
+struct written_rule {
+	struct term match[5][5];
+	struct term replace[5][5];
+	float chance;
+	bool mirror_x, mirror_y;
+};
+
+enum {
+	STATEMENT_ELEMENT,
+	STATEMENT_MEMBER, // An identity of the last element
+	STATEMENT_RULE
+};
+
+struct statement {
+	int kind;
+	int line_number;
+	uint32_t color; // Of an element
+	char bind; // Key bound to an element, 0 if none
+	struct span name; // Of a member's identity
+	struct written_rule rule;
+};
+
+struct parser {
+	const char* filepath;
+	const char* at; // Start of the next line
+	const char* end;
+	int line_number;
+	struct span symbols[256]; // Definitions, no text for undefined symbols
+	struct statement* statements;
+	int n_statements, statements_capacity;
+};
+
+static bool parseError(struct parser* p, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	printf("\033[0;31m%s - Couldn't load rules: ", p->filepath);
+	vprintf(format, args);
+	printf(". Line #%d\033[0m\n", p->line_number);
+	va_end(args);
+	return false;
+}
+
+static bool nextLine(struct parser* p, struct span* line) {
+	if(p->at >= p->end)
+		return false;
+	const char* newline = (const char*)memchr(p->at, '\n', p->end - p->at);
+	const char* stop = newline != NULL ? newline : p->end;
+	line->text = p->at;
+	line->length = stop - p->at;
+	p->at = newline != NULL ? newline + 1 : p->end;
+	p->line_number++;
+	return true;
+}
+
+static const char* skipSpace(const char* at, const char* end) {
+	while(at < end && isspace((uint8_t)*at))
+		at++;
+	return at;
+}
+
+// Cuts the next term off the front of 'line': a list in parentheses, a name in quotes, or anything else up
+// to the next space. Returns false if only spaces are left
+static bool nextTerm(struct span* line, struct span* term) {
+	const char* end = line->text + line->length;
+	const char* at = skipSpace(line->text, end);
+	if(at == end)
+		return false;
+	const char* stop = at + 1;
+	if(*at == '(' || *at == '"') {
+		char close = *at == '(' ? ')' : '"';
+		while(stop < end && *stop != close)
+			stop++;
+		if(stop < end)
+			stop++;
+	} else
+		while(stop < end && !isspace((uint8_t)*stop))
+			stop++;
+	term->text = at;
+	term->length = stop - at;
+	line->text = stop;
+	line->length = end - stop;
+	return true;
+}
+
+static bool spanIs(struct span span, const char* text) {
+	return span.length == (int)strlen(text) && strncmp(span.text, text, span.length) == 0;
+}
+
+// "#rrggbb" as an opaque ARGB color
+static bool parseColor(struct span term, uint32_t* color) {
+	if(term.length != 7 || term.text[0] != '#')
+		return false;
+	char hex[7];
+	memcpy(hex, term.text + 1, 6);
+	hex[6] = '\0';
+	*color = (uint32_t)strtol(hex, NULL, 16) + (uint32_t)(255 << 24);
+	return true;
+}
+
+// The numbers of "(a, b, ...)", returns how many there are or -1 if it's something else
+static int parseNumbers(struct span term, long* numbers, int max) {
+	char text[64];
+	if(term.length < 2 || term.length >= 64 || term.text[term.length-1] != ')')
+		return -1;
+	memcpy(text, term.text + 1, term.length - 2);
+	text[term.length - 2] = '\0';
+	int n = 0;
+	for(char* at = text;;) {
+		char* after;
+		long number = strtol(at, &after, 10);
+		if(after == at || n == max)
+			return -1;
+		numbers[n++] = number;
+		while(isspace((uint8_t)*after))
+			after++;
+		if(*after == '\0')
+			return n;
+		if(*after != ',')
+			return -1;
+		at = after + 1;
+	}
+}
+
+// Reads term 'column' of a rule's 'row', from the replace block if 'replace'. A symbol stands for the term
+// it was defined as
+static bool readTerm(struct parser* p, struct span term, bool replace, int row, int column, struct term* out) {
+	if(term.length == 1 && term.text[0] != '*') {
+		struct span definition = p->symbols[(uint8_t)term.text[0]];
+		if(definition.text == NULL)
+			return parseError(p, "Unknown symbol '%c'", term.text[0]);
+		nextTerm(&definition, &term);
+	}
+	memset(out, 0, sizeof(struct term));
+	long numbers[5];
+	int n_numbers = replace ? parseNumbers(term, numbers, 5) : -1;
+	if(term.text[0] == '*')
+		out->type = -1;
+	else if(parseColor(term, &out->value))
+		out->type = 0;
+	else if(term.text[0] == '#')
+		return parseError(p, "It looks like you intended to write a color in \"%.*s\", colors are written as \"#\" followed by exactly and only 6 hex characters", term.length, term.text);
+	else if(term.text[0] == '"' && term.length >= 2 && term.text[term.length-1] == '"') {
+		out->type = replace ? 3 : 1;
+		out->name.text = term.text + 1;
+		out->name.length = term.length - 2;
+	} else if(n_numbers == 2) {
+		out->type = 1;
+		out->refX = numbers[0];
+		out->refY = numbers[1];
+	} else if(n_numbers == 5) {
+		out->type = 2;
+		out->refX = numbers[0];
+		out->refY = numbers[1];
+		out->value = ((uint32_t)((uint8_t)numbers[2])<<16) + ((uint32_t)((uint8_t)numbers[3])<<8) + ((uint32_t)(uint8_t)numbers[4]);
+	} else
+		return parseError(p, "Unknown %s term syntax \"%.*s\", term #%d of rule row #%d", replace ? "replacement" : "matching", term.length, term.text, column + 1, row + 1);
+	return true;
+}
+
+// The five rows under a "rule:" line. The rest of that line holds the chance as a percentage and x and/or
+// y for the mirrored rules
+static bool parseRule(struct parser* p, struct span header, struct written_rule* rule) {
+	rule->chance = 1;
+	rule->mirror_x = rule->mirror_y = false;
+	bool chance_read = false;
+	for(int k = 5; k < header.length; k++) {
+		char c = header.text[k];
+		rule->mirror_x |= c == 'x';
+		rule->mirror_y |= c == 'y';
+		if(!chance_read && (isdigit((uint8_t)c) || c == '.')) {
+			int start = k;
+			while(k + 1 < header.length && (isdigit((uint8_t)header.text[k+1]) || header.text[k+1] == '.'))
+				k++;
+			if(k + 1 < header.length && header.text[k+1] == '%' && k - start < 31) {
+				char number[32];
+				memcpy(number, header.text + start, k - start + 1);
+				number[k - start + 1] = '\0';
+				rule->chance = strtof(number, NULL) / 100.f;
+				chance_read = true;
+			}
+		}
+	}
+
+	for(int i = 0; i < 5; i++) {
+		struct span line, term;
+		if(!nextLine(p, &line))
+			return parseError(p, "End of file before end of rule");
+		for(int j = 0; j < 10; j++) {
+			if(i == 2 && j == 5 && (!nextTerm(&line, &term) || !spanIs(term, "=>")))
+				return parseError(p, "Expected \"=>\" between the match and replace blocks of a rule's middle row");
+			if(!nextTerm(&line, &term))
+				return parseError(p, "Not enough terms in rule's row #%d (Need 10 terms total, 5 match + 5 replace!)", i + 1);
+			if(!readTerm(p, term, j >= 5, i, j % 5, j < 5 ? &rule->match[i][j] : &rule->replace[i][j-5]))
+				return false;
+		}
+		// Anything after the tenth term is ignored, as it always has been
+	}
+	return true;
+}
+
+static struct statement* addStatement(struct parser* p, int kind) {
+	if(p->n_statements == p->statements_capacity) {
+		p->statements_capacity = p->statements_capacity ? p->statements_capacity*2 : 64;
+		p->statements = (struct statement*)realloc(p->statements, sizeof(struct statement)*p->statements_capacity);
+	}
+	struct statement* statement = p->statements + p->n_statements++;
+	statement->kind = kind;
+	statement->line_number = p->line_number;
+	return statement;
+}
+
+static bool parseFile(struct parser* p) {
+	bool after_element = false; // Whether identity lines may follow
+	struct span line;
+	while(nextLine(p, &line)) {
+		const char* end = line.text + line.length;
+		const char* at = skipSpace(line.text, end);
+		if(at == end) {
+			after_element = false;
+			continue;
+		}
+
+		// rule:
+		if(line.length >= 5 && strncmp(line.text, "rule:", 5) == 0) {
+			after_element = false;
+			if(!parseRule(p, line, &addStatement(p, STATEMENT_RULE)->rule))
+				return false;
+			continue;
+		}
+
+		// - "identity", under an element
+		if(*at == '-' && after_element) {
+			const char* name = skipSpace(at + 1, end);
+			const char* close = name < end && *name == '"' ? (const char*)memchr(name + 1, '"', end - name - 1) : NULL;
+			if(close == NULL)
+				return parseError(p, "Identities of an element are written as - \"name\"");
+			struct statement* member = addStatement(p, STATEMENT_MEMBER);
+			member->name.text = name + 1;
+			member->name.length = close - name - 1;
+			continue;
+		}
+		after_element = false;
+
+		// s => term
+		const char* arrow = skipSpace(line.text + 1, end);
+		if(!isspace((uint8_t)line.text[0]) && end - arrow >= 2 && arrow[0] == '=' && arrow[1] == '>') {
+			struct span definition = {skipSpace(arrow + 2, end), 0};
+			const char* last = end;
+			while(last > definition.text && isspace((uint8_t)last[-1]))
+				last--;
+			definition.length = last - definition.text;
+			if(definition.length == 0)
+				return parseError(p, "Symbol '%c' is defined as nothing", line.text[0]);
+			p->symbols[(uint8_t)line.text[0]] = definition;
+			continue;
+		}
+
+		// #rrggbb: key
+		if(line.text[0] == '#') {
+			struct span color = {line.text, 7};
+			struct statement* element = addStatement(p, STATEMENT_ELEMENT);
+			if(line.length < 8 || line.text[7] != ':' || (line.length > 8 && !isspace((uint8_t)line.text[8])) || !parseColor(color, &element->color))
+				return parseError(p, "Elements are written as \"#\" followed by exactly and only 6 hex characters and a colon");
+			const char* bind = skipSpace(line.text + 8, end);
+			element->bind = bind < end ? *bind : 0;
+			after_element = true;
+			continue;
+		}
+
+		return parseError(p, "Unable to parse line, did you intend to write a symbol => definition? Symbols can only be 1 character");
+	}
+	return true;
+}
+
+// Counts an identity the files would add, false if there's no bit left for it. With 'replace', none of
+// the loaded identities are kept
+static bool countIdentity(struct sand_world* world, struct parser* p, struct span name, struct span* added, int* n_added, bool replace) {
+	if(!replace && findIdentity(world, name.text, name.length) != -1)
+		return true;
+	for(int a = 0; a < *n_added; a++)
+		if(added[a].length == name.length && strncmp(added[a].text, name.text, name.length) == 0)
+			return true;
+	if((replace ? 0 : world->n_identities) + *n_added >= MAX_IDENTITIES)
+		return parseError(p, "Couldn't create identity \"%.*s\": Only %d identities are supported", name.length, name.text, MAX_IDENTITIES);
+	added[(*n_added)++] = name;
+	return true;
+}
+
+// Whether the world has room for the new identities and rules of the parsed files, on top of the loaded
+// ones or with 'replace' in their place
+static bool checkRoom(struct sand_world* world, struct parser** files, int n_files, bool replace) {
+	struct span added[MAX_IDENTITIES];
+	int n_added = 0, n_rules = 0;
+	for(int f = 0; f < n_files; f++) {
+		struct parser* p = files[f];
+		for(int s = 0; s < p->n_statements; s++) {
+			const struct statement* statement = p->statements + s;
+			p->line_number = statement->line_number;
+			if(statement->kind == STATEMENT_MEMBER && !countIdentity(world, p, statement->name, added, &n_added, replace))
+				return false;
+			if(statement->kind != STATEMENT_RULE)
+				continue;
+			const struct written_rule* rule = &statement->rule;
+			for(int i = 0; i < 5; i++)
+				for(int j = 0; j < 5; j++) {
+					if(rule->match[i][j].type == 1 && !countIdentity(world, p, rule->match[i][j].name, added, &n_added, replace))
+						return false;
+					if(rule->replace[i][j].type == 3 && !countIdentity(world, p, rule->replace[i][j].name, added, &n_added, replace))
+						return false;
+				}
+			n_rules += 1 + rule->mirror_x + rule->mirror_y + (rule->mirror_x && rule->mirror_y);
+			if((replace ? 0 : world->n_rules) + n_rules > MAX_RULES)
+				return parseError(p, "Only %d rules are supported, counting mirrors", MAX_RULES);
+		}
+	}
+	return true;
+}
+
+static int identityOf(struct sand_world* world, struct span name) {
+	int identity = findIdentity(world, name.text, name.length);
+	return identity != -1 ? identity : addIdentity(world, name.text, name.length);
+}
+
+// Looks up a written rule's elements and identities, row by row, and adds it and its mirrors
+static void addRule(struct sand_world* world, const struct written_rule* written) {
+	struct rule rule;
+	memset(&rule, 0, sizeof(struct rule));
+	rule.chance = written->chance;
+	for(int i = 0; i < 5; i++) {
+		for(int j = 0; j < 5; j++) {
+			const struct term* term = &written->match[i][j];
+			rule.match[i][j].type = term->type;
+			rule.match[i][j].value = term->type == 0 ? intern(world, term->value) : term->type == 1 ? identityOf(world, term->name) : 0;
+		}
+		for(int j = 0; j < 5; j++) {
+			const struct term* term = &written->replace[i][j];
+			struct replace_t* replace = &rule.replace[i][j];
+			replace->type = term->type;
+			replace->refX = term->refX;
+			replace->refY = term->refY;
+			replace->value = term->type == 0 ? intern(world, term->value) : term->type == 2 ? term->value : term->type == 3 ? identityOf(world, term->name) : 0;
+		}
+	}
+	finishRule(&rule, NULL);
+
+	world->rules[world->n_rules] = rule;
+	world->n_rules++;
+	if (written->mirror_x) {
+		// Create x-mirrored version of rule
+		world->rules[world->n_rules] = rule;
+		for(int i = 0; i < 5; i++) {
+			for(int j = 0; j < 5; j++) {
+				world->rules[world->n_rules].match[i][j] = rule.match[i][4-j];
+				world->rules[world->n_rules].replace[i][j] = rule.replace[i][4-j];
+				if(world->rules[world->n_rules].replace[i][j].type>=1)// is reference or edit
+					world->rules[world->n_rules].replace[i][j].refX *= -1;
+			}
+		}
+		world->n_rules++;
+	}
+	if (written->mirror_y) {
+		// Create y-mirrored version of rule
+		world->rules[world->n_rules] = rule;
+		for(int i = 0; i < 5; i++) {
+			for(int j = 0; j < 5; j++) {
+				world->rules[world->n_rules].match[i][j] = rule.match[4-i][j];
+				world->rules[world->n_rules].replace[i][j] = rule.replace[4-i][j];
+				if(world->rules[world->n_rules].replace[i][j].type>=1)// is reference or edit
+					world->rules[world->n_rules].replace[i][j].refY *= -1;
+			}
+		}
+		if(written->mirror_x) {
+			// y-mirrored AND x-mirrored
+			// Perform y-mirror on (n_rules-1)/x-mirrored rule
+			world->n_rules++;
+			world->rules[world->n_rules] = rule;
+			for(int i = 0; i < 5; i++) {
+				for(int j = 0; j < 5; j++) {
+					world->rules[world->n_rules].match[i][j] = rule.match[4-i][4-j];
+					world->rules[world->n_rules].replace[i][j] = rule.replace[4-i][4-j];
+					if(world->rules[world->n_rules].replace[i][j].type>=1) {// is reference or edit
+						world->rules[world->n_rules].replace[i][j].refX *= -1;
+						world->rules[world->n_rules].replace[i][j].refY *= -1;
+					}
+				}
+			}
+		}
+		world->n_rules++;
+	}
+}
+
+// Names the rules added for a written rule after where it was written, the original and its mirrors in the
+// order addRule adds them
+static void setOrigins(struct sand_world* world, int first, const char* filepath, int line_number, const struct written_rule* written) {
+	const char* slash = strrchr(filepath, '/');
+	const char* name = slash != NULL ? slash + 1 : filepath;
+	const char* mirrors[4] = {"", written->mirror_x ? " x" : " y", written->mirror_x ? " y" : "", " xy"};
+	for(int r = first; r < world->n_rules; r++)
+		snprintf(world->rules[r].origin, sizeof(world->rules[r].origin), "%s:%d%s", name, line_number, mirrors[r - first]);
+}
+
+// Brings a parsed file into the world, in the order it was written in: that order decides the element IDs
+// and identity indices
+static void applyStatements(struct sand_world* world, const struct parser* p) {
+	uint16_t element = AIR_ID;
+	for(int s = 0; s < p->n_statements; s++) {
+		const struct statement* statement = p->statements + s;
+		if(statement->kind == STATEMENT_ELEMENT) {
+			element = intern(world, statement->color);
+			if(statement->bind != 0)
+				world->binds[toupper((uint8_t)statement->bind)] = statement->color;
+		} else if(statement->kind == STATEMENT_MEMBER) {
+			int identity_index = identityOf(world, statement->name);
+			if(isIdentity(world, identity_index, element))
+				continue;
+			struct identity *id = world->identities + identity_index;
+			id->members = realloc(id->members, sizeof(uint16_t)*(id->member_count+1));
+			id->members[id->member_count] = element;
+			id->member_count++;
+			world->masks[element] |= (uint64_t)1 << identity_index;
+		} else {
+			int first = world->n_rules;
+			addRule(world, &statement->rule);
+			setOrigins(world, first, p->filepath, statement->line_number, &statement->rule);
+		}
+	}
+}
+
+static struct parser* parseText(const char* filepath, const char* text, size_t size) {
+	struct parser* p = (struct parser*)calloc(1, sizeof(struct parser));
+	p->filepath = filepath;
+	p->at = text;
+	p->end = text + size;
+	if(parseFile(p))
+		return p;
+	free(p->statements);
+	free(p);
+	return NULL;
+}
+
+static void freeParser(struct parser* p) {
+	if(p == NULL)
+		return;
+	free(p->statements);
+	free(p);
+}
+
+// Loads the rules of a ruleset file's contents, all of them or none
+static bool loadText(struct sand_world* world, const char* filepath, const char* text, size_t size) {
+	struct parser* p = parseText(filepath, text, size);
+	bool loaded = p != NULL && checkRoom(world, &p, 1, false);
+	if(loaded)
+		applyStatements(world, p);
+	freeParser(p);
+	return loaded;
+}
+
+// The whole of a file, NULL if it can't be read
+static char* readFile(const char* filepath, size_t* size) {
+	FILE* f = fopen(filepath, "rb");
+	if(f == NULL)
+		return NULL;
+	char* text = NULL;
+	long length;
+	if(fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+		text = (char*)malloc(length + 1);
+		if(fread(text, 1, length, f) != (size_t)length) {
+			free(text);
+			text = NULL;
+		} else
+			*size = length;
+	}
+	fclose(f);
+	return text;
+}
+
+// Rules were just added or replaced
+static void rulesLoaded(struct sand_world* world) {
+	chooseAnchors(world);
+	compileRules(world);
+	world->network_stale = true;
+	// Identity masks may have changed under the cells that are already in the world, and the new rules may fit in sleeping chunks
+	rebuildRegions(world);
+	recountPresence(world);
+	wakeAll(world);
+}
+
+bool sandLoadRule(struct sand_world* world, const char* filepath) {
+	size_t size;
+	char* text = readFile(filepath, &size);
+	if(text == NULL)
+		return false;
+	bool loaded = loadText(world, filepath, text, size);
+	free(text);
+	if(loaded)
+		rulesLoaded(world);
+	return loaded;
+}
+
+// Reads every file of 'directory', in the order it lists them. Returns NULL if it can't be opened
+static struct rule_file* readDirectory(const char* directory, int* n_files, bool list) {
+	DIR *dir;
+	struct dirent *ent;
+	if((dir = opendir(directory))==NULL)
+		return NULL;
+	struct rule_file* files = (struct rule_file*)malloc(sizeof(struct rule_file));
+	*n_files = 0;
+	while((ent=readdir(dir))!=NULL) {
+		if(ent->d_name[0] == '.')
+			continue;
+		if(list)
+			printf("%s\n",ent->d_name);
+		char* rule_file = (char*)malloc(strlen(directory)+strlen(ent->d_name)+2);
+		strcpy(rule_file, directory);
+		strcat(rule_file, "/");
+		strcat(rule_file, ent->d_name);
+		size_t size;
+		char* text = readFile(rule_file, &size);
+		if(text == NULL) {
+			free(rule_file);
+			continue;
+		}
+		files = (struct rule_file*)realloc(files, sizeof(struct rule_file)*(*n_files+1));
+		files[*n_files].path = rule_file;
+		files[*n_files].name = rule_file + strlen(directory) + 1;
+		files[*n_files].text = text;
+		files[*n_files].size = size;
+		(*n_files)++;
+	}
+	closedir(dir);
+	return files;
+}
+
+static void freeFiles(struct rule_file* files, int n_files) {
+	for(int f = 0; f < n_files; f++) {
+		free(files[f].path);
+		free(files[f].text);
+	}
+	free(files);
+}
+
+int sandLoadRulesCached(struct sand_world* world, const char* directory, const char* cache_path) {
+	int n_files;
+	struct rule_file* files = readDirectory(directory, &n_files, true);
+	if(files == NULL)
+		return 0;
+
+	// A cache holds element IDs and identity indices as they come out of loading into an empty world
+	int loaded = 0;
+	bool empty = world->n_rules == 0 && world->n_identities == 0 && world->n_elements == 1;
+	uint64_t key = cacheKey(files, n_files);
+	if(cache_path != NULL && empty && loadCache(world, cache_path, key)) {
+		printf("Loaded %d rules from \"%s\"\n", world->n_rules, cache_path);
+		loaded = n_files;
+	} else {
+		for(int f = 0; f < n_files; f++)
+			if(loadText(world, files[f].path, files[f].text, files[f].size))
+				loaded++;
+		if(cache_path != NULL && empty && loaded == n_files)
+			writeCache(world, cache_path, key);
+	}
+	if(loaded > 0)
+		rulesLoaded(world);
+	freeFiles(files, n_files);
+	return loaded;
+}
+
+// Every file of a directory, parsed but not loaded. See sandWatchRules
+struct parsed_rules {
+	struct rule_file* files;
+	struct parser** parsers;
+	int n_files;
+};
+
+// Parses every file of 'directory', NULL if it can't be read or a file is malformed
+struct parsed_rules* parseDirectory(const char* directory) {
+	struct parsed_rules* parsed = (struct parsed_rules*)calloc(1, sizeof(struct parsed_rules));
+	parsed->files = readDirectory(directory, &parsed->n_files, false);
+	if(parsed->files == NULL) {
+		free(parsed);
+		return NULL;
+	}
+	parsed->parsers = (struct parser**)calloc(parsed->n_files + 1, sizeof(struct parser*));
+	for(int f = 0; f < parsed->n_files; f++)
+		if((parsed->parsers[f] = parseText(parsed->files[f].path, parsed->files[f].text, parsed->files[f].size)) == NULL) {
+			freeParsedRules(parsed);
+			return NULL;
+		}
+	return parsed;
+}
+
+void freeParsedRules(struct parsed_rules* parsed) {
+	if(parsed == NULL)
+		return;
+	for(int f = 0; f < parsed->n_files; f++)
+		freeParser(parsed->parsers[f]);
+	free(parsed->parsers);
+	freeFiles(parsed->files, parsed->n_files);
+	free(parsed);
+}
+
+// Frees the loaded rules and identities, and takes the identities off the elements
+void clearRules(struct sand_world* world) {
+	for(int i = 0; i < world->n_identities; i++) {
+		free((char*)world->identities[i].name);
+		free(world->identities[i].members);
+	}
+	world->n_identities = 0;
+	for(int i = 0; i < world->n_rules; i++) {
+		// Mirrored rules share their original's search_for
+		if(i == 0 || world->rules[i].search_for != world->rules[i-1].search_for)
+			free(world->rules[i].search_for);
+	}
+	world->n_rules = 0;
+	memset(world->masks, 0, sizeof(uint64_t)*world->n_elements);
+	memset(world->binds, 0, sizeof(world->binds));
+}
+
+// Puts the parsed rules in place of the loaded ones, or returns false and keeps the loaded ones if they
+// don't fit. The palette stays, elements only get added to it, so the cells keep their meaning
+bool replaceRules(struct sand_world* world, struct parsed_rules* parsed) {
+	if(!checkRoom(world, parsed->parsers, parsed->n_files, true))
+		return false;
+	clearRules(world);
+	for(int f = 0; f < parsed->n_files; f++)
+		applyStatements(world, parsed->parsers[f]);
+	rulesLoaded(world);
+	sandResetProfile(world); // The counters were of the rules' old indices
+	return true;
+}
+
+int sandLoadRules(struct sand_world* world, const char* directory) {
+	return sandLoadRulesCached(world, directory, NULL);
+}
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include "internal.h"
+
+void put(struct sand_world* world, uint16_t element, int x, int y) {
+	size_t index = x + (size_t)y * world->width;
+	uint16_t old = world->cells[index];
+	if(old == element)
+		return;
+	world->cells[index] = element;
+#ifdef SAND_PROFILE
+	world->heat[index]++;
+#endif
+	regionMove(world, &world->chunks[x / CHUNK_SIZE + y / CHUNK_SIZE * world->chunks_x].region, old, element);
+	presenceMove(world, old, element, x, y);
+	touch(world, x, y);
+	if(world->worklist != NULL)
+		worklistWrite(world, x, y);
+}
+
+uint16_t get(struct sand_world* world, int x, int y) {
+	if(x < 0 || x >= world->width || y < 0 || y >= world->height)
+		return AIR_ID;
+	return world->cells[x + (size_t)y * world->width];
+}
+
+// Whether the elements the rule looks for are all around the 5x5 footprint at (x, y), which lies in at most 2x2 tiles
+bool potential(struct sand_world* world, const struct rule* rule, int x, int y) {
+	if(x >= world->width || x + 5 < 0 || y >= world->height || y + 5 < 0)
+		return false;
+	return presenceCovers(tilePresence(world, x, y, x + 4, y + 4), rule->needs);
+}
+
+static bool check(struct sand_world* world, const struct check* check, uint16_t element) {
+	return check->type == 0 ? element == check->value : (world->masks[element] >> check->value) & 1;
+}
+
+// Whether the rule's match block fits at (x, y), without rolling its chance
+bool fits(struct sand_world* world, const struct rule* rule, int x, int y) {
+	if(rule->compiled != NULL)
+		return rule->compiled->fits(world, x, y);
+	// Non-wildcard cells never fit out of bounds
+	if(rule->n_checks > 0 && (x + rule->footprint.left < 0 || x + rule->footprint.right >= world->width
+		|| y + rule->footprint.top < 0 || y + rule->footprint.bottom >= world->height))
+		return false;
+	if(!potential(world, rule, x, y))
+		return false;
+	const uint16_t* cells = world->cells + x + (ptrdiff_t)y * world->width;
+	for(int c = 0; c < rule->n_checks; c++)
+		if(!check(world, rule->program + c, cells[rule->program[c].offset]))
+			return false;
+	return true;
+}
+
+void enforce(struct sand_world* world, const struct rule* rule, int x, int y, struct rng* rng) {
+	if(rule->compiled != NULL) {
+		rule->compiled->enforce(world, x, y, rng);
+		return;
+	}
+	uint16_t source[5][5];
+	
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; j+y >=0 && j+y < world->height && i < 5; i++) {
+			if(rule->replace[j][i].type == -1 || i + x < 0 || i + x >= world->width)
+				continue;
+			if(rule->replace[j][i].type == 0) // Set as element
+				source[j][i] = rule->replace[j][i].value;
+			if(rule->replace[j][i].type >= 1) // Set to referenced pixel
+				source[j][i] = get(world, i+x+rule->replace[j][i].refX, j+y+rule->replace[j][i].refY);
+			if(rule->replace[j][i].type == 2) { // Set to edited referenced pixel
+				uint32_t col = world->colors[source[j][i]];
+				source[j][i] = intern(world,  ((((col>>16)&0xff)+(int8_t)((rule->replace[j][i].value>>16)&0xff)) << 16)
+											+ ((((col>> 8)&0xff)+(int8_t)((rule->replace[j][i].value>> 8)&0xff)) <<  8)
+											+ (col&0xff)+(int8_t)(rule->replace[j][i].value&0xff)
+											+ (col&0xff000000));
+			}
+			if(rule->replace[j][i].type == 3) {
+				struct identity* id = world->identities + rule->replace[j][i].value;
+				if(id->member_count == 0)
+					source[j][i] = get(world, i + x, j + y);
+				else
+					source[j][i] = id->members[random32(rng) % id->member_count];
+			}
+		}
+	
+	
+	for(int j = 0; j < 5; j++)
+		for(int i = 0; j+y >=0 && j+y < world->height && i < 5; i++) {
+			if(rule->replace[j][i].type == -1 || i + x < 0 || i + x >= world->width)
+				continue;
+			put(world, source[j][i], i+x, j+y);
+		}
+}
+
+struct sand_world* sandCreateWorld(int width, int height) {
+	struct sand_world* world = (struct sand_world*)calloc(1, sizeof(struct sand_world));
+	world->width = width;
+	world->height = height;
+	createPalette(world);
+	world->cells = (uint16_t*)calloc((size_t)width*height, sizeof(uint16_t)); // All AIR_ID
+	world->iterations = ITERATIONS;
+	world->stepping = STEPPING;
+	world->sleep_after = 2*STEPPING*STEPPING;
+
+	createPresence(world);
+	createChunks(world);
+	recountPresence(world);
+	world->tasks = (int*)malloc(sizeof(int)*world->chunks_x*world->chunks_y);
+	world->serial = createPool(1);
+	world->pool = createPool(1);
+	createProfile(world);
+
+	// Setup identities
+	world->identities = (struct identity*)malloc(sizeof(struct identity)*1);
+
+	// Set up rules
+	world->rules = (struct rule*)malloc(sizeof(struct rule)*MAX_RULES);
+	return world;
+}
+
+void sandDestroyWorld(struct sand_world* world) {
+	if(world == NULL)
+		return;
+	sandFinishCheckpoint(world);
+	sandStopRecording(world);
+	stopWatch(world);
+	destroyPool(world->pool);
+	destroyPool(world->serial);
+	destroyProfile(world);
+	destroyView(world);
+	destroyWorklist(world);
+	destroyNetwork(world);
+	free(world->tasks);
+	destroyChunks(world);
+	destroyPresence(world);
+	clearRules(world);
+	free(world->identities);
+	free(world->rules);
+	free(world->dispatch);
+	free(world->cells);
+	destroyPalette(world);
+	free(world);
+}
+
+// Largest value <= v that is congruent to 'phase' modulo 'stepping'
+static int alignDown(int v, int phase, int stepping) {
+	return v - ((v - phase) % stepping + stepping) % stepping;
+}
+
+// Rare rules (chance below SAMPLE_BELOW) aren't rolled every time the dispatch offers them. Flipping a
+// coin at each offer is the same as drawing, after each try, how many offers pass before the next one,
+// from a geometric distribution. So each such slot counts down the offers it skips and only draws when
+// it is tried. Rules with higher chances are cheaper to just roll
+struct sampler {
+	int64_t skip[MAX_RULES]; // Offers left to skip, -1 when the next count hasn't been drawn
+};
+
+// Offers to skip before the rule's next try
+static int64_t sampleSkip(const struct rule* rule, struct rng* rng) {
+	if(rule->chance <= 0)
+		return INT64_MAX;
+	double skip = floor(log(randomUnit(rng)) / rule->log_fail);
+	return skip < (double)INT64_MAX / 2 ? (int64_t)skip : INT64_MAX / 2;
+}
+
+// Whether the slot's rule gets tried at this offer
+static bool rollSlot(struct sampler* sampler, int slot, const struct rule* rule, struct rng* rng) {
+	if(rule->chance >= 1)
+		return true;
+	if(rule->chance >= SAMPLE_BELOW)
+		return random32(rng) < rule->threshold;
+	if(sampler->skip[slot] < 0)
+		sampler->skip[slot] = sampleSkip(rule, rng);
+	if(sampler->skip[slot] > 0) {
+		sampler->skip[slot]--;
+		return false;
+	}
+	sampler->skip[slot] = -1;
+	return true;
+}
+
+// Slots of the window whose rules might fit somewhere in the area swept, according to the tiles under it.
+// Only the sweep itself writes there, so after each enforce it's enough to add what the rule wrote
+struct possible {
+	struct presence presence;
+	struct slots slots;
+	bool any;
+};
+
+static void computePossible(struct sand_world* world, struct possible* possible, struct presence presence) {
+	possible->presence = presence;
+	possible->any = false;
+	memset(&possible->slots, 0, sizeof(struct slots));
+	for(int s = 0; s < world->n_rules; s++)
+		if(presenceCovers(presence, world->rules[world->slot_rules[s]].needs)) {
+			possible->slots.bits[s / 64] |= (uint64_t)1 << (s % 64);
+			possible->any = true;
+		}
+}
+
+static void updatePossible(struct sand_world* world, struct possible* possible, int x, int y) {
+	struct presence written = tilePresence(world, x, y, x + 4, y + 4);
+	if((written.identities & ~possible->presence.identities) | (written.elements & ~possible->presence.elements)) {
+		written.identities |= possible->presence.identities;
+		written.elements |= possible->presence.elements;
+		computePossible(world, possible, written);
+	}
+}
+
+// Rules checked against a position and rules enforced, summed into the world's after each chunk
+struct counts {
+	uint64_t evaluations, matches;
+#ifdef SAND_PROFILE
+	struct rule_profile* profile; // The worker's
+#endif
+};
+
+// Profiling builds time every offer of a rule and count what came of it, see struct rule_profile
+#ifdef SAND_PROFILE
+#define PROFILE_OFFER(counts, r) struct rule_profile* profile = (counts)->profile + (r); uint64_t offered_at = profileClock(); profile->offered++
+#define PROFILE_OUTCOME(outcome) (profile->outcome++, profile->cycles += profileClock() - offered_at)
+#else
+#define PROFILE_OFFER(counts, r) ((void)0)
+#define PROFILE_OUTCOME(outcome) ((void)0)
+#endif
+
+// Slots whose rules might fit at (x, y). The network only offers the slots whose rules fit
+static void offeredSlots(struct sand_world* world, int x, int y, const struct possible* possible, struct slots* slots) {
+	if(world->network != NULL)
+		networkSlots(world, x, y, slots);
+	else
+		candidates(world, x, y, slots);
+	for(int w = 0; w < world->slot_words; w++)
+		slots->bits[w] &= possible->slots.bits[w];
+}
+
+static void sweepPosition(struct sand_world* world, int x, int y, struct rng* rng, struct sampler* sampler, struct possible* possible, struct counts* counts) {
+	if(!possible->any)
+		return;
+	// Slots are tried in order, like the full loop over every rule would
+	bool network = world->network != NULL;
+	struct slots slots;
+	offeredSlots(world, x, y, possible, &slots);
+	// Re-dispatching refills the words already gone through too, they aren't looked at again
+	for(int w = 0; w < world->slot_words; w++)
+		while(slots.bits[w]) {
+			int slot = w*64 + __builtin_ctzll(slots.bits[w]);
+			slots.bits[w] &= slots.bits[w] - 1;
+			struct rule* rule = world->rules + world->slot_rules[slot];
+			PROFILE_OFFER(counts, world->slot_rules[slot]);
+			if(!rollSlot(sampler, slot, rule, rng)) {
+				PROFILE_OUTCOME(chance);
+				continue;
+			}
+			counts->evaluations++;
+			if(network || fits(world, rule, x, y)) {
+				counts->matches++;
+				enforce(world, rule, x, y, rng);
+				// New elements may have made more rules possible, and the anchors may have changed. Re-dispatch the slots after this one
+				updatePossible(world, possible, x, y);
+				offeredSlots(world, x, y, possible, &slots);
+				slots.bits[w] &= slot % 64 == 63 ? 0 : ~(uint64_t)0 << (slot % 64 + 1);
+				PROFILE_OUTCOME(matches);
+			} else {
+				PROFILE_OUTCOME(misses);
+#ifdef SAND_PROFILE
+				// Off the clock, so the split doesn't cost the rule
+				profile->potential += !potential(world, rule, x, y);
+#endif
+			}
+		}
+}
+
+// Simulate the positions owned by a chunk bottom to top for style, with the row and column offsets
+// and the direction of the current iteration. The sweep is blocked by chunk already: the windows of a
+// chunk's positions cover 36x36 cells, a few KB that stay in L1 whatever the width of the world, so the
+// cells stay row by row, which the rules' cell offsets, fitsRow and the network rely on
+static void sweepChunk(struct sand_world* world, int cx, int cy, struct rng* rng, struct counts* counts) {
+	uint32_t step = world->step;
+	int stepping = world->stepping;
+	int ystart = world->height+3 - (step/stepping);
+	int xstart = -4 + (step%stepping);
+	int dir = (step%2)==0?1:-1;
+	int xphase = dir == 1 ? xstart : world->width-xstart;
+
+	int left, right, top, bottom;
+	chunkPositions(world, cx, cy, &left, &right, &top, &bottom);
+	if(bottom > ystart)
+		bottom = ystart;
+	struct sampler sampler;
+	memset(sampler.skip, 0xff, sizeof(int64_t)*world->n_rules);
+	struct possible possible;
+	computePossible(world, &possible, tilePresence(world, left, top, right + 4, bottom + 4));
+	int first = dir == 1 ? alignDown(left + stepping - 1, xphase, stepping) : alignDown(right, xphase, stepping);
+	const struct worklist* worklist = world->worklist;
+	for(int j = alignDown(bottom, ystart, stepping); j >= top; j-=stepping)
+		for(int i = first; i >= left && i <= right; i+=dir*stepping)
+			if(worklist == NULL || positionLive(worklist, i, j))
+				sweepPosition(world, i, j, rng, &sampler, &possible, counts);
+}
+
+static void sweepTask(void* context, int task, int worker) {
+	struct sand_world* world = (struct sand_world*)context;
+	int chunk = world->tasks[task];
+	// Every chunk gets its own stream, so results don't depend on which thread ran it
+	struct rng rng;
+	seedRandom(&rng, world->seed, world->iteration, chunk);
+	if(world->checkpoint != NULL)
+		preserveAround(world, chunk);
+	struct counts counts = {0, 0};
+#ifdef SAND_PROFILE
+	counts.profile = world->profile + (size_t)worker*MAX_RULES;
+#endif
+	sweepChunk(world, chunk % world->chunks_x, chunk / world->chunks_x, &rng, &counts);
+	__atomic_add_fetch(&world->evaluations, counts.evaluations, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&world->matches, counts.matches, __ATOMIC_RELAXED);
+}
+
+void sandStep(struct sand_world* world, int steps) {
+	if(world->watch != NULL)
+		reloadRules(world);
+	if(world->checkpoint != NULL)
+		reapCheckpoint(world);
+	if(world->n_rules == 0)
+		return;
+	if(world->use_network && (world->network == NULL || world->network_stale)) {
+		world->network_stale = false;
+		if(!buildNetwork(world)) {
+			printf("\033[0;31mThe rules make too large a network, falling back to anchor dispatch\033[0m\n");
+			world->use_network = false;
+		}
+	}
+	for(int s = 0; s < steps; s++) {
+		for(int iter = 0; iter < world->iterations; iter++) {
+			buildDispatch(world);
+			// Checkerboard of chunks: in each pass the awake chunks are at least a chunk apart, further than a
+			// rule can reach (see chooseAnchors), so they can be swept in parallel. Chunks woken by an earlier
+			// pass are picked up from the woken list
+			for(int pass = 0; pass < 4; pass++) {
+				int n_tasks = 0;
+				int n_woken = world->n_woken;
+				for(int a = 0; a < world->n_awake + n_woken; a++) {
+					int c = a < world->n_awake ? world->awake[a] : world->woken[a - world->n_awake];
+					if((c % world->chunks_x) % 2 == pass % 2 && (c / world->chunks_x) % 2 == pass / 2)
+						world->tasks[n_tasks++] = c;
+				}
+				poolRun(world->reach_ok ? world->pool : world->serial, n_tasks, sweepTask, world);
+			}
+			updateChunks(world);
+			world->iteration++;
+			world->step++;
+			if(world->step>=world->stepping*world->stepping)
+				world->step = 0;
+		}
+		if(world->recording != NULL)
+			recordStep(world);
+	}
+}
+
+void sandSetThreads(struct sand_world* world, int threads) {
+	destroyPool(world->pool);
+	world->pool = createPool(threads);
+	resizeProfile(world);
+}
+
+void sandSetNetwork(struct sand_world* world, bool enabled) {
+	world->use_network = enabled;
+	if(!enabled)
+		destroyNetwork(world);
+}
+
+void sandSeed(struct sand_world* world, uint64_t seed) {
+	world->seed = seed;
+}
+
+bool sandSetSweep(struct sand_world* world, int iterations, int stepping) {
+	if(iterations < 1 || stepping < 1 || stepping > MAX_STEPPING) {
+		printf("\033[0;31mSweep of %d iterations with stepping %d is not supported, stepping must be 1 to %d\033[0m\n", iterations, stepping, MAX_STEPPING);
+		return false;
+	}
+	world->iterations = iterations;
+	world->stepping = stepping;
+	world->sleep_after = 2*stepping*stepping;
+	world->step = 0;
+	return true;
+}
+
+void sandPut(struct sand_world* world, uint32_t color, int x, int y) {
+	if(x < 0 || x >= world->width || y < 0 || y >= world->height)
+		return;
+	if(world->checkpoint != NULL)
+		preserveCell(world, x, y);
+	put(world, intern(world, color), x, y);
+}
+
+uint32_t sandGet(struct sand_world* world, int x, int y) {
+	return world->colors[get(world, x, y)];
+}
+
+void sandPaint(struct sand_world* world, uint32_t color, int x, int y, float size) {
+	if(x < 0 || x >= world->width || y < 0 || y >= world->height)
+		return;
+	uint16_t element = intern(world, color);
+	for(int i = x+1 - size; i < x + size; i++)
+		for(int j = y+1 - size; i>=0&&i<world->width&&j < y + size; j++)
+			if(j>=0&&j<world->height) {
+				if(world->checkpoint != NULL)
+					preserveCell(world, i, j);
+				put(world, element, i, j);
+			}
+}
+
+void sandRender(struct sand_world* world, uint32_t* pixels, int pitch) {
+	for(int j = 0; j < world->height; j++) {
+		uint32_t* row = (uint32_t*)((uint8_t*)pixels + (size_t)j*pitch);
+		uint16_t* cells = world->cells + (size_t)j*world->width;
+		for(int i = 0; i < world->width; i++)
+			row[i] = world->colors[cells[i]];
+	}
+}
+
+void sandCounts(struct sand_world* world, uint64_t* evaluations, uint64_t* matches) {
+	*evaluations = world->evaluations;
+	*matches = world->matches;
+}
+
+int sandWidth(struct sand_world* world) {
+	return world->width;
+}
+
+int sandHeight(struct sand_world* world) {
+	return world->height;
+}
+
+int sandRuleCount(struct sand_world* world) {
+	return world->n_rules;
+}
+
+uint32_t sandBind(struct sand_world* world, char key) {
+	return world->binds[toupper((uint8_t)key)];
+}
@@ -0,0 +1,140 @@
+#ifndef SAND_H
+#define SAND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Headless simulation core. Everything the engine needs (rules, identities, the world grid) lives
+// behind a 'struct sand_world', so the SDL front end in source.c is just one client of this API.
+
+#define SAND_COL(r,g,b) ((uint32_t)((r)<<16)+(uint32_t)((g)<<8)+(uint32_t)(b)+(uint32_t)(255<<24))
+
+#define SAND_AIR SAND_COL(155, 215, 232)
+
+struct sand_world;
+
+// Create a world of the given size, filled with AIR and with no rules loaded
+struct sand_world* sandCreateWorld(int width, int height);
+void sandDestroyWorld(struct sand_world* world);
+
+// Load a single .ruleset file, returns false if the file couldn't be read or is malformed. Nothing of a
+// malformed file is loaded
+bool sandLoadRule(struct sand_world* world, const char* filepath);
+// Load every file in 'directory', returns the number of files that were loaded
+int sandLoadRules(struct sand_world* world, const char* directory);
+// sandLoadRules, through a cache of the resolved rules at 'cache_path'. When the world has nothing loaded
+// yet and the cache was made from the same files, the rules are mapped in from it instead of parsed.
+// Otherwise they're parsed, and the cache is rewritten if every file loaded into an empty world
+int sandLoadRulesCached(struct sand_world* world, const char* directory, const char* cache_path);
+// Reload the rules whenever a file in 'directory' changes, without restarting the world. The files are
+// parsed in the background and swapped in as a whole at the start of the next sandStep, in place of every
+// loaded rule. Elements keep their IDs, so the cells stay as they are. If a file is malformed the running
+// rules stay. Returns false if the directory can't be watched, which needs inotify (Linux)
+bool sandWatchRules(struct sand_world* world, const char* directory);
+
+// Write the loaded rules out as C to be built into the program, see 'make aot'. Returns false if 'path'
+// couldn't be written
+bool sandWriteCompiled(struct sand_world* world, const char* path);
+// Run the loaded rules with the code generated for them, 'sand_compiled_rules' of the generated file. The
+// same rules must have been loaded in the same order, returns false and keeps interpreting them otherwise
+struct sand_compiled;
+bool sandUseCompiled(struct sand_world* world, const struct sand_compiled* compiled);
+
+// Run 'steps' simulation steps. One step is what the front end runs per rendered frame
+void sandStep(struct sand_world* world, int steps);
+
+// Each step runs 'iterations' sweeps, 4 by default. A sweep tries the rules at every 'stepping'th
+// position (2 by default, at most 5), cycling through the offsets over stepping*stepping sweeps.
+// Returns false and leaves the sweep alone for values out of range
+bool sandSetSweep(struct sand_world* world, int iterations, int stepping);
+// Sweep with up to 'threads' threads, 1 by default. The result doesn't depend on the number of threads
+void sandSetThreads(struct sand_world* world, int threads);
+// Match with one network compiled from every loaded rule instead of dispatching rules by an anchor cell and
+// checking them one by one. It reads each cell at most once per position. Off by default, it falls back
+// to dispatch if the rules make too large a network
+void sandSetNetwork(struct sand_world* world, bool enabled);
+// Only sweep the positions where something might happen: where a rule fits, or a cell of its window was
+// written lately. Rules fire with the same odds and the result still doesn't depend on the number of
+// threads, but it's a different run than sweeping every position. Faster when awake parts of the world are
+// mostly still, about even when most of them keep changing. Off by default
+void sandSetWorklist(struct sand_world* world, bool enabled);
+// Seed the world's random streams. The same seed, rules and starting world always give the same result
+void sandSeed(struct sand_world* world, uint64_t seed);
+
+// Read and write single cells as ARGB colors. Out of bounds reads return SAND_AIR
+void sandPut(struct sand_world* world, uint32_t color, int x, int y);
+uint32_t sandGet(struct sand_world* world, int x, int y);
+// Fill the square brush of 'size' around (x, y), the same brush the front end paints with
+void sandPaint(struct sand_world* world, uint32_t color, int x, int y, float size);
+// Copy the world as ARGB colors into 'pixels', 'pitch' is the length of a row in bytes
+void sandRender(struct sand_world* world, uint32_t* pixels, int pitch);
+
+// Drawing from another thread than the one stepping. sandPublish, called between steps, brings a copy of the
+// world's colors up to date with the chunks that changed and makes it the latest view. sandTakeView hands
+// the drawing thread the latest view, if one was published since it last took one, with the areas that
+// changed since then. Neither waits on the other, the view taken stays as it is until the next take
+struct sand_rect {
+	int x, y, w, h;
+};
+struct sand_view {
+	const uint32_t* pixels; // ARGB, a row is sandWidth colors
+	const struct sand_rect* rects; // Whole chunks that changed since the view taken before
+	int n_rects;
+};
+void sandPublish(struct sand_world* world);
+bool sandTakeView(struct sand_world* world, struct sand_view* view);
+
+// Save the world to a snapshot at 'path' in the background. The world is captured as it is now, stepping
+// and painting carry on while it's written. Returns false if the last checkpoint is still being written
+bool sandCheckpoint(struct sand_world* world, const char* path);
+// Wait for the checkpoint being written, if any. Returns false if it couldn't be written
+bool sandFinishCheckpoint(struct sand_world* world);
+// Replace the world's cells with a snapshot of a world the same size. With the same rules loaded the run
+// carries on where it was saved, seed and all. Returns false and leaves the world alone if it can't be read
+bool sandRestore(struct sand_world* world, const char* path);
+// Size of the world saved at 'path', or false if it isn't a snapshot
+bool sandSnapshotSize(const char* path, int* width, int* height);
+
+// Record the run to 'path' from now on: the world as it is, then the cells each step changes, with the
+// whole world again every 'keyframe_every' steps to seek to. The file is written in the background.
+// Returns false if it can't be opened
+bool sandRecord(struct sand_world* world, const char* path, int keyframe_every);
+// Stop recording and wait for the recording to be written. Returns false if it couldn't be
+bool sandStopRecording(struct sand_world* world);
+
+// Play back a recording without running any rules. Frame 0 is the world as recording started, each frame
+// after it one step later. Returns NULL if 'path' isn't a recording. A recording that was cut off plays
+// up to its last whole frame
+struct sand_replay;
+struct sand_replay* sandOpenReplay(const char* path);
+void sandCloseReplay(struct sand_replay* replay);
+// Show 'frame', clamped to the recording. Returns the frame shown. Seeking decodes the keyframe before
+// the frame and the steps after it, playing forward only decodes the new steps
+int sandSeekReplay(struct sand_replay* replay, int frame);
+int sandReplayFrame(struct sand_replay* replay);
+int sandReplayFrames(struct sand_replay* replay);
+int sandReplayWidth(struct sand_replay* replay);
+int sandReplayHeight(struct sand_replay* replay);
+uint32_t sandReplayGet(struct sand_replay* replay, int x, int y);
+void sandRenderReplay(struct sand_replay* replay, uint32_t* pixels, int pitch);
+
+// Totals since the world was created: rules checked against a position (after dispatch and their chance
+// roll) and rules that fit and were enforced. With the network matching, only fitting rules are offered,
+// so the two are the same
+void sandCounts(struct sand_world* world, uint64_t* evaluations, uint64_t* matches);
+
+// Profiling, only built in with SAND_PROFILE (see 'make profile'), otherwise these do nothing and return
+// false. Print each rule's counts since the last reset, costliest first: the times dispatch offered it,
+// what became of the offers and the time spent on them. Reloading the rules resets the counts
+bool sandPrintProfile(struct sand_world* world);
+void sandResetProfile(struct sand_world* world);
+// Draw how often each cell was written since the last reset into 'pixels', as ARGB to lay over sandRender
+bool sandRenderHeat(struct sand_world* world, uint32_t* pixels, int pitch);
+
+int sandWidth(struct sand_world* world);
+int sandHeight(struct sand_world* world);
+int sandRuleCount(struct sand_world* world);
+// Element color bound to 'key' by a ruleset ("#rrggbb: k"), or 0 if the key is unbound
+uint32_t sandBind(struct sand_world* world, char key);
+
+#endif
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "internal.h"
+
+// World snapshots. A snapshot holds the palette once, then the cells chunk by chunk as runs of elements,
+// with an index of where each chunk's runs start so chunks decode on their own. sandRestore maps the
+// file and decodes the chunks straight out of the mapping, spread over the sweep threads.
+//
+// sandCheckpoint writes one in the background from a copy-on-write frame of the world. Each chunk is
+// copied into the frame once, by whichever gets to it first: the writer thread, going through the chunks
+// in order, or a sweep or paint about to write to it. A step copies at most the few chunks it's about to
+// touch, it never waits on the disk.
+//
+// Layout, in the host's byte order: the header, offsets[n_chunks + 1] of each chunk's runs, colors, then
+// the runs. A run is the number of cells less one and the element, both as LEB128
+// varints, over a chunk's cells row by row.
+
+#define SNAPSHOT_MAGIC 0x50414e53444e4153ull // "SANDSNAP"
+#define SNAPSHOT_VERSION 2
+
+struct snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t chunk_size;
+	uint32_t n_colors;
+	// Where the world was in its run: its seed, iteration and sweep offset. Restored when the same rules are
+	// loaded, so the run carries on as if it never stopped
+	uint32_t n_rules;
+	uint64_t seed;
+	uint64_t iteration;
+	uint32_t step;
+	uint32_t stepping; // That 'step' is an offset of
+	uint64_t runs_size;
+};
+
+enum {
+	FRAME_PENDING,
+	FRAME_COPYING,
+	FRAME_COPIED
+};
+
+struct checkpoint {
+	char* path;
+	pthread_t thread;
+	struct sand_world* world; // Only the cells of chunks being copied are read
+	struct snapshot_header header;
+	uint32_t* colors;
+	int n_chunks;
+	uint8_t* state; // Of each chunk in the frame
+	uint16_t* frame; // CHUNK_SIZE*CHUNK_SIZE cells for each chunk, row by row
+	bool finished; // Set by the writer thread, atomically
+	bool written;
+};
+
+// Cells of chunk 'c', clipped to a world of the given size
+static void chunkArea(int c, int chunk_size, int width, int height, int* left, int* top, int* columns, int* rows) {
+	int chunks_x = (width + chunk_size - 1) / chunk_size;
+	*left = c % chunks_x * chunk_size;
+	*top = c / chunks_x * chunk_size;
+	*columns = *left + chunk_size <= width ? chunk_size : width - *left;
+	*rows = *top + chunk_size <= height ? chunk_size : height - *top;
+}
+
+// Copies chunk 'c' into the frame unless it's there already, waiting if another thread is copying it
+static void preserveChunk(struct sand_world* world, struct checkpoint* checkpoint, int c) {
+	uint8_t* state = checkpoint->state + c;
+	if(__atomic_load_n(state, __ATOMIC_ACQUIRE) == FRAME_COPIED)
+		return;
+	uint8_t pending = FRAME_PENDING;
+	if(__atomic_compare_exchange_n(state, &pending, FRAME_COPYING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		int left, top, columns, rows;
+		chunkArea(c, CHUNK_SIZE, world->width, world->height, &left, &top, &columns, &rows);
+		uint16_t* frame = checkpoint->frame + (size_t)c*CHUNK_SIZE*CHUNK_SIZE;
+		for(int j = 0; j < rows; j++)
+			memcpy(frame + j*columns, world->cells + left + (size_t)(top + j)*world->width, sizeof(uint16_t)*columns);
+		__atomic_store_n(state, FRAME_COPIED, __ATOMIC_RELEASE);
+	} else
+		while(__atomic_load_n(state, __ATOMIC_ACQUIRE) != FRAME_COPIED)
+			sched_yield();
+}
+
+// A sweep of the chunk is about to write to it or its neighbors
+void preserveAround(struct sand_world* world, int chunk) {
+	int cx = chunk % world->chunks_x, cy = chunk / world->chunks_x;
+	for(int y = cy - 1; y <= cy + 1; y++)
+		for(int x = cx - 1; x <= cx + 1; x++)
+			if(x >= 0 && x < world->chunks_x && y >= 0 && y < world->chunks_y)
+				preserveChunk(world, world->checkpoint, x + y*world->chunks_x);
+}
+
+// The cell at (x, y), in the world, is about to be written
+void preserveCell(struct sand_world* world, int x, int y) {
+	preserveChunk(world, world->checkpoint, x / CHUNK_SIZE + y / CHUNK_SIZE * world->chunks_x);
+}
+
+static void* checkpointThread(void* data) {
+	struct checkpoint* checkpoint = (struct checkpoint*)data;
+	struct sand_world* world = checkpoint->world;
+	struct snapshot_header* header = &checkpoint->header;
+	uint64_t* offsets = (uint64_t*)calloc(checkpoint->n_chunks + 1, sizeof(uint64_t));
+	// A run takes at most 5 bytes, a varint below 2^10 and one below 2^16
+	uint8_t* runs = (uint8_t*)malloc(5*CHUNK_SIZE*CHUNK_SIZE);
+
+	char* temporary;
+	FILE* f = createReplacement(checkpoint->path, &temporary);
+	bool written = f != NULL
+		&& fwrite(header, sizeof(struct snapshot_header), 1, f) == 1
+		&& fwrite(offsets, sizeof(uint64_t), checkpoint->n_chunks + 1, f) == (size_t)checkpoint->n_chunks + 1
+		&& fwrite(checkpoint->colors, sizeof(uint32_t), header->n_colors, f) == header->n_colors;
+	for(int c = 0; c < checkpoint->n_chunks; c++) {
+		preserveChunk(world, checkpoint, c);
+		int left, top, columns, rows;
+		chunkArea(c, CHUNK_SIZE, world->width, world->height, &left, &top, &columns, &rows);
+		const uint16_t* cells = checkpoint->frame + (size_t)c*CHUNK_SIZE*CHUNK_SIZE;
+		int n_cells = columns*rows, size = 0;
+		for(int i = 0; i < n_cells;) {
+			int run = 1;
+			while(i + run < n_cells && cells[i + run] == cells[i])
+				run++;
+			size += putVarint(runs + size, run - 1);
+			size += putVarint(runs + size, cells[i]);
+			i += run;
+		}
+		offsets[c + 1] = offsets[c] + size;
+		written = written && fwrite(runs, 1, size, f) == (size_t)size;
+	}
+	header->runs_size = offsets[checkpoint->n_chunks];
+	written = written && fseek(f, 0, SEEK_SET) == 0
+		&& fwrite(header, sizeof(struct snapshot_header), 1, f) == 1
+		&& fwrite(offsets, sizeof(uint64_t), checkpoint->n_chunks + 1, f) == (size_t)checkpoint->n_chunks + 1;
+	written = replaceFile(f, temporary, checkpoint->path, written, "snapshot");
+	free(runs);
+	free(offsets);
+	checkpoint->written = written;
+	__atomic_store_n(&checkpoint->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static bool endCheckpoint(struct sand_world* world) {
+	struct checkpoint* checkpoint = world->checkpoint;
+	pthread_join(checkpoint->thread, NULL);
+	bool written = checkpoint->written;
+	free(checkpoint->path);
+	free(checkpoint->colors);
+	free(checkpoint->state);
+	free(checkpoint->frame);
+	free(checkpoint);
+	world->checkpoint = NULL;
+	return written;
+}
+
+// Lets go of the last checkpoint if it's been written. Runs between steps
+void reapCheckpoint(struct sand_world* world) {
+	if(__atomic_load_n(&world->checkpoint->finished, __ATOMIC_ACQUIRE))
+		endCheckpoint(world);
+}
+
+bool sandCheckpoint(struct sand_world* world, const char* path) {
+	if(world->checkpoint != NULL)
+		reapCheckpoint(world);
+	if(world->checkpoint != NULL)
+		return false;
+	struct checkpoint* checkpoint = (struct checkpoint*)calloc(1, sizeof(struct checkpoint));
+	checkpoint->path = (char*)malloc(strlen(path) + 1);
+	strcpy(checkpoint->path, path);
+	checkpoint->world = world;
+	struct snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, world->width, world->height, CHUNK_SIZE, world->n_elements,
+		world->n_rules, world->seed, world->iteration, world->step, (uint32_t)world->stepping, 0};
+	checkpoint->header = header;
+	checkpoint->colors = (uint32_t*)malloc(sizeof(uint32_t)*world->n_elements);
+	memcpy(checkpoint->colors, world->colors, sizeof(uint32_t)*world->n_elements);
+	checkpoint->n_chunks = world->chunks_x*world->chunks_y;
+	checkpoint->state = (uint8_t*)calloc(checkpoint->n_chunks, sizeof(uint8_t));
+	checkpoint->frame = (uint16_t*)malloc(sizeof(uint16_t)*CHUNK_SIZE*CHUNK_SIZE*checkpoint->n_chunks);
+	world->checkpoint = checkpoint;
+	if(pthread_create(&checkpoint->thread, NULL, checkpointThread, checkpoint) != 0) {
+		printf("\033[0;31mCouldn't start writing the snapshot \"%s\"\033[0m\n", path);
+		free(checkpoint->path);
+		free(checkpoint->colors);
+		free(checkpoint->state);
+		free(checkpoint->frame);
+		free(checkpoint);
+		world->checkpoint = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool sandFinishCheckpoint(struct sand_world* world) {
+	if(world->checkpoint == NULL)
+		return true;
+	return endCheckpoint(world);
+}
+
+struct restore {
+	struct sand_world* world;
+	const struct snapshot_header* header;
+	const uint64_t* offsets;
+	const uint8_t* runs;
+	int n_chunks;
+	const uint16_t* elements; // World element of each of the snapshot's, once it decoded whole
+	uint16_t* cells; // Decoded into, as the snapshot's elements
+	bool broken; // Set by any of the pool's threads, atomically
+};
+
+static void restoreTask(void* context, int task, int worker) {
+	struct restore* restore = (struct restore*)context;
+	const struct snapshot_header* header = restore->header;
+	int left, top, columns, rows;
+	chunkArea(task, header->chunk_size, header->width, header->height, &left, &top, &columns, &rows);
+	const uint8_t* at = restore->runs + restore->offsets[task];
+	const uint8_t* end = restore->runs + restore->offsets[task + 1];
+	int n_cells = columns*rows;
+	for(int i = 0; i < n_cells;) {
+		uint32_t run, element;
+		if(!getVarint(&at, end, &run) || !getVarint(&at, end, &element) || element >= header->n_colors || run >= (uint32_t)(n_cells - i)) {
+			__atomic_store_n(&restore->broken, true, __ATOMIC_RELAXED);
+			return;
+		}
+		uint16_t value = (uint16_t)element;
+		// Runs of a settled world are long, fill them a row at a time
+		for(run++; run > 0;) {
+			int column = i % columns, span = columns - column < (int)run ? columns - column : (int)run;
+			uint16_t* cells = restore->cells + left + column + (size_t)(top + i / columns)*header->width;
+			for(int k = 0; k < span; k++)
+				cells[k] = value;
+			i += span;
+			run -= span;
+		}
+	}
+	if(at != end)
+		__atomic_store_n(&restore->broken, true, __ATOMIC_RELAXED);
+}
+
+// From the snapshot's elements to the world's
+static void remapTask(void* context, int task, int worker) {
+	struct restore* restore = (struct restore*)context;
+	const struct snapshot_header* header = restore->header;
+	uint16_t* cells = restore->cells + (size_t)task*header->width;
+	for(uint32_t i = 0; i < header->width; i++)
+		cells[i] = restore->elements[cells[i]];
+}
+
+// Whether the mapped snapshot adds up, with its chunks' runs within the file
+static bool checkSnapshot(const uint8_t* data, size_t size, struct restore* restore) {
+	const struct snapshot_header* header = (const struct snapshot_header*)data;
+	if(size < sizeof(struct snapshot_header) || header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION
+		|| header->chunk_size < 1 || header->chunk_size > 4096 || header->n_colors < 1 || header->n_colors > MAX_ELEMENTS
+		|| header->n_rules > MAX_RULES || header->width < 1 || header->height < 1)
+		return false;
+	uint64_t n_chunks = (uint64_t)((header->width + header->chunk_size - 1) / header->chunk_size) * ((header->height + header->chunk_size - 1) / header->chunk_size);
+	uint64_t runs = sizeof(struct snapshot_header) + sizeof(uint64_t)*(n_chunks + 1) + sizeof(uint32_t)*(uint64_t)header->n_colors;
+	if(runs + header->runs_size != size)
+		return false;
+	restore->header = header;
+	restore->offsets = (const uint64_t*)(data + sizeof(struct snapshot_header));
+	restore->runs = data + runs;
+	restore->n_chunks = n_chunks;
+	if(restore->offsets[0] != 0 || restore->offsets[n_chunks] != header->runs_size)
+		return false;
+	for(uint64_t c = 0; c < n_chunks; c++)
+		if(restore->offsets[c + 1] < restore->offsets[c])
+			return false;
+	return true;
+}
+
+bool sandSnapshotSize(const char* path, int* width, int* height) {
+	size_t size;
+	const uint8_t* data = mapFile(path, &size);
+	if(data == NULL)
+		return false;
+	struct restore restore;
+	bool valid = checkSnapshot(data, size, &restore);
+	if(valid) {
+		*width = restore.header->width;
+		*height = restore.header->height;
+	}
+	unmapFile(data, size);
+	return valid;
+}
+
+bool sandRestore(struct sand_world* world, const char* path) {
+	sandFinishCheckpoint(world);
+	size_t size;
+	const uint8_t* data = mapFile(path, &size);
+	if(data == NULL) {
+		printf("\033[0;31mCouldn't open the snapshot \"%s\"\033[0m\n", path);
+		return false;
+	}
+	struct restore restore = {world};
+	if(!checkSnapshot(data, size, &restore) || restore.header->width != (uint32_t)world->width || restore.header->height != (uint32_t)world->height) {
+		printf("\033[0;31m\"%s\" isn't a snapshot of a %dx%d world\033[0m\n", path, world->width, world->height);
+		unmapFile(data, size);
+		return false;
+	}
+	const struct snapshot_header* header = restore.header;
+	const uint32_t* colors = (const uint32_t*)(restore.offsets + restore.n_chunks + 1);
+
+	restore.cells = (uint16_t*)malloc(sizeof(uint16_t)*world->width*world->height);
+	poolRun(world->pool, restore.n_chunks, restoreTask, &restore);
+	if(__atomic_load_n(&restore.broken, __ATOMIC_RELAXED)) {
+		printf("\033[0;31mThe snapshot \"%s\" is damaged\033[0m\n", path);
+		free(restore.cells);
+		unmapFile(data, size);
+		return false;
+	}
+	// The snapshot's palette joins the world's, in order. With the same rules loaded the IDs come out the
+	// same and the cells need no remapping
+	uint16_t* elements = (uint16_t*)malloc(sizeof(uint16_t)*header->n_colors);
+	bool same_ids = true;
+	for(uint32_t e = 0; e < header->n_colors; e++) {
+		elements[e] = intern(world, colors[e]);
+		same_ids = same_ids && elements[e] == e;
+	}
+	restore.elements = elements;
+	if(!same_ids)
+		poolRun(world->pool, world->height, remapTask, &restore);
+	free(elements);
+	free(world->cells);
+	world->cells = restore.cells;
+	if(world->recording != NULL)
+		recordEverything(world);
+	if(world->view != NULL)
+		viewEverything(world);
+
+	// Carry on the run if it's the same rules and sweep. The rules' order comes from the seed and iteration
+	if(header->n_rules == (uint32_t)world->n_rules && header->stepping == (uint32_t)world->stepping
+		&& header->step < header->stepping*header->stepping) {
+		world->seed = header->seed;
+		world->iteration = header->iteration;
+		world->step = header->step;
+	}
+	unmapFile(data, size);
+
+	rebuildRegions(world);
+	recountPresence(world);
+	wakeAll(world);
+	return true;
+}
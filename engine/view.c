@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// Views of the world for drawing it from another thread, see sandPublish. There are three copies of the
+// world's colors: the one the stepping thread brings up to date, the latest published one and the one the
+// drawing thread is reading. Publishing and taking each swap their copy with the latest, so neither thread
+// ever waits on the other and the drawing thread always gets the newest whole step.
+//
+// Each chunk has a version, bumped when the chunk changed since the last publish (updateChunks passes its
+// flags on, like it does for recordings). A copy remembers the version of each of its chunks, publishing
+// only copies the chunks it's behind on, and taking hands out the chunks whose version differs from the
+// one the drawing thread was last given, as rectangles to upload
+
+#define FRESH 4 // Set in 'latest' when it was published since the last take
+
+struct view_copy {
+	uint32_t* pixels;
+	uint32_t* versions;
+};
+
+struct view {
+	struct view_copy copies[3];
+	int back; // The stepping thread's copy
+	int latest; // Swapped by both threads, the copy's index with FRESH
+	int front; // The drawing thread's copy
+	uint32_t* versions; // Of each chunk in the world
+	uint8_t* dirty; // Chunks changed since the last publish
+	uint32_t* shown; // Versions of the chunks the drawing thread was last given
+	struct sand_rect* rects;
+};
+
+static struct view* createView(struct sand_world* world) {
+	int n_chunks = world->chunks_x*world->chunks_y;
+	struct view* view = (struct view*)calloc(1, sizeof(struct view));
+	for(int k = 0; k < 3; k++) {
+		view->copies[k].pixels = (uint32_t*)malloc(sizeof(uint32_t)*world->width*world->height);
+		view->copies[k].versions = (uint32_t*)calloc(n_chunks, sizeof(uint32_t));
+	}
+	view->back = 0;
+	view->latest = 1;
+	view->front = 2;
+	// Every copy starts behind on every chunk
+	view->versions = (uint32_t*)malloc(sizeof(uint32_t)*n_chunks);
+	for(int c = 0; c < n_chunks; c++)
+		view->versions[c] = 1;
+	view->dirty = (uint8_t*)calloc(n_chunks, sizeof(uint8_t));
+	view->shown = (uint32_t*)calloc(n_chunks, sizeof(uint32_t));
+	// A rectangle per run of changed chunks in a row of chunks, at most every other chunk
+	view->rects = (struct sand_rect*)malloc(sizeof(struct sand_rect)*((world->chunks_x + 1) / 2)*world->chunks_y);
+	return view;
+}
+
+void destroyView(struct sand_world* world) {
+	struct view* view = world->view;
+	if(view == NULL)
+		return;
+	for(int k = 0; k < 3; k++) {
+		free(view->copies[k].pixels);
+		free(view->copies[k].versions);
+	}
+	free(view->versions);
+	free(view->dirty);
+	free(view->shown);
+	free(view->rects);
+	free(view);
+	world->view = NULL;
+}
+
+void viewChanged(struct sand_world* world, int chunk) {
+	world->view->dirty[chunk] = 1;
+}
+
+// The cells were replaced wholesale
+void viewEverything(struct sand_world* world) {
+	memset(world->view->dirty, 1, world->chunks_x*world->chunks_y);
+}
+
+static void copyChunk(struct sand_world* world, uint32_t* pixels, int chunk) {
+	int left = chunk % world->chunks_x * CHUNK_SIZE, top = chunk / world->chunks_x * CHUNK_SIZE;
+	int right = left + CHUNK_SIZE < world->width ? left + CHUNK_SIZE : world->width;
+	int bottom = top + CHUNK_SIZE < world->height ? top + CHUNK_SIZE : world->height;
+	for(int j = top; j < bottom; j++) {
+		const uint16_t* cells = world->cells + (size_t)j*world->width;
+		uint32_t* row = pixels + (size_t)j*world->width;
+		for(int i = left; i < right; i++)
+			row[i] = world->colors[cells[i]];
+	}
+}
+
+void sandPublish(struct sand_world* world) {
+	struct view* view = world->view;
+	if(view == NULL) {
+		view = createView(world);
+		__atomic_store_n(&world->view, view, __ATOMIC_RELEASE);
+	}
+	struct view_copy* back = view->copies + view->back;
+	for(int c = 0; c < world->chunks_x*world->chunks_y; c++) {
+		// Cells put since the last step haven't been through updateChunks yet
+		if(view->dirty[c] || world->chunks[c].changed) {
+			view->dirty[c] = 0;
+			view->versions[c]++;
+		}
+		if(back->versions[c] != view->versions[c]) {
+			copyChunk(world, back->pixels, c);
+			back->versions[c] = view->versions[c];
+		}
+	}
+	view->back = __atomic_exchange_n(&view->latest, view->back | FRESH, __ATOMIC_ACQ_REL) & ~FRESH;
+}
+
+bool sandTakeView(struct sand_world* world, struct sand_view* taken) {
+	struct view* view = __atomic_load_n(&world->view, __ATOMIC_ACQUIRE);
+	if(view == NULL || !(__atomic_load_n(&view->latest, __ATOMIC_ACQUIRE) & FRESH))
+		return false;
+	view->front = __atomic_exchange_n(&view->latest, view->front, __ATOMIC_ACQ_REL) & ~FRESH;
+	const struct view_copy* front = view->copies + view->front;
+	// Runs of chunks along each row of chunks that changed since the last take
+	int n_rects = 0;
+	for(int cy = 0; cy < world->chunks_y; cy++)
+		for(int cx = 0; cx < world->chunks_x; cx++) {
+			int c = cx + cy*world->chunks_x;
+			if(front->versions[c] == view->shown[c])
+				continue;
+			int end = cx;
+			for(; end < world->chunks_x && front->versions[end + cy*world->chunks_x] != view->shown[end + cy*world->chunks_x]; end++)
+				view->shown[end + cy*world->chunks_x] = front->versions[end + cy*world->chunks_x];
+			struct sand_rect* rect = view->rects + n_rects++;
+			rect->x = cx*CHUNK_SIZE;
+			rect->y = cy*CHUNK_SIZE;
+			rect->w = (end*CHUNK_SIZE < world->width ? end*CHUNK_SIZE : world->width) - rect->x;
+			rect->h = ((cy + 1)*CHUNK_SIZE < world->height ? (cy + 1)*CHUNK_SIZE : world->height) - rect->y;
+			cx = end;
+		}
+	taken->pixels = front->pixels;
+	taken->rects = view->rects;
+	taken->n_rects = n_rects;
+	return true;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+// Live reloading of a rules directory, see sandWatchRules. A thread waits on inotify for the directory's
+// files to change, lets a burst of changes settle, and parses the whole directory again. The parsed rules
+// wait in 'pending' until the next sandStep swaps them in, between steps, while nothing is swept. Only
+// Linux has inotify, elsewhere directories can't be watched.
+
+#ifdef __linux__
+
+#define SETTLE_MS 100 // Quiet time after the last change before reparsing, editors save in several writes
+
+struct watch {
+	char* directory;
+	pthread_t thread;
+	int inotify;
+	int stop[2]; // Pipe, written to stop the thread
+	pthread_mutex_t lock;
+	struct parsed_rules* pending; // Under the lock
+};
+
+static void* watchThread(void* data) {
+	struct watch* watch = (struct watch*)data;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = {{watch->inotify, POLLIN, 0}, {watch->stop[0], POLLIN, 0}};
+	int timeout = -1; // Waiting for a change, or for a burst of them to settle
+	for(;;) {
+		int ready = poll(fds, 2, timeout);
+		if(ready < 0)
+			continue; // Interrupted
+		if(fds[1].revents)
+			return NULL;
+		if(ready > 0) {
+			// Dot files are left out of loading, so changes to them (editor swap files) don't count
+			ssize_t length = read(watch->inotify, events, sizeof(events));
+			for(ssize_t at = 0; at < length;) {
+				const struct inotify_event* event = (const struct inotify_event*)(events + at);
+				if(event->len == 0 || event->name[0] != '.')
+					timeout = SETTLE_MS;
+				at += sizeof(struct inotify_event) + event->len;
+			}
+			continue;
+		}
+
+		timeout = -1;
+		struct parsed_rules* parsed = parseDirectory(watch->directory);
+		if(parsed == NULL) {
+			printf("\033[0;31mKeeping the running rules until \"%s\" loads again\033[0m\n", watch->directory);
+			continue;
+		}
+		pthread_mutex_lock(&watch->lock);
+		freeParsedRules(watch->pending);
+		watch->pending = parsed;
+		pthread_mutex_unlock(&watch->lock);
+	}
+}
+
+static void closeWatch(struct watch* watch) {
+	if(watch->inotify != -1)
+		close(watch->inotify);
+	if(watch->stop[0] != -1) {
+		close(watch->stop[0]);
+		close(watch->stop[1]);
+	}
+	pthread_mutex_destroy(&watch->lock);
+	freeParsedRules(watch->pending);
+	free(watch->directory);
+	free(watch);
+}
+
+bool sandWatchRules(struct sand_world* world, const char* directory) {
+	stopWatch(world);
+	struct watch* watch = (struct watch*)calloc(1, sizeof(struct watch));
+	watch->directory = (char*)malloc(strlen(directory) + 1);
+	strcpy(watch->directory, directory);
+	watch->stop[0] = watch->stop[1] = -1;
+	pthread_mutex_init(&watch->lock, NULL);
+	watch->inotify = inotify_init1(IN_CLOEXEC);
+	if(watch->inotify == -1 || inotify_add_watch(watch->inotify, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1
+		|| pipe(watch->stop) != 0 || pthread_create(&watch->thread, NULL, watchThread, watch) != 0) {
+		printf("\033[0;31mCouldn't watch \"%s\" for changes\033[0m\n", directory);
+		closeWatch(watch);
+		return false;
+	}
+	world->watch = watch;
+	return true;
+}
+
+void stopWatch(struct sand_world* world) {
+	struct watch* watch = world->watch;
+	if(watch == NULL)
+		return;
+	if(write(watch->stop[1], "", 1) != 1)
+		pthread_cancel(watch->thread);
+	pthread_join(watch->thread, NULL);
+	closeWatch(watch);
+	world->watch = NULL;
+}
+
+// Swaps in the rules parsed since the last step, if there are any
+void reloadRules(struct sand_world* world) {
+	struct watch* watch = world->watch;
+	pthread_mutex_lock(&watch->lock);
+	struct parsed_rules* parsed = watch->pending;
+	watch->pending = NULL;
+	pthread_mutex_unlock(&watch->lock);
+	if(parsed == NULL)
+		return;
+	if(replaceRules(world, parsed))
+		printf("Reloaded %d rules from \"%s\"\n", world->n_rules, watch->directory);
+	else
+		printf("\033[0;31mKeeping the running rules until \"%s\" loads again\033[0m\n", watch->directory);
+	freeParsedRules(parsed);
+}
+
+#else
+
+bool sandWatchRules(struct sand_world* world, const char* directory) {
+	printf("\033[0;31mCouldn't watch \"%s\" for changes: Only supported on Linux\033[0m\n", directory);
+	return false;
+}
+
+void stopWatch(struct sand_world* world) {
+}
+
+void reloadRules(struct sand_world* world) {
+}
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// Active positions, see sandSetWorklist. Sleeping chunks already skip the settled parts of the world, but
+// an awake chunk sweeps all of its positions, even when something happens at only a few of them.
+//
+// A position is settled when no rule fits there, so sweeping it can't change any cell. That stays true until
+// a cell of its window changes. Skipping it does change the run, the dice it would have rolled go to the
+// positions after it, but every rule that fits still fires with its chance. The run is as deterministic as
+// one without the worklist, though it isn't the same run.
+// put() marks the positions whose window it wrote as fresh. Every sleep_after iterations the awake
+// chunks check their pending positions, the ones written before the last check and not since, and drop the
+// settled ones. Either way a position isn't checked again before its next write, the answer can't change.
+// Loading rules or restoring a snapshot wakes everything, see wakeAll, which makes every position live.
+
+// The bits 'n' bits wide at 'start' in a row of words, n <= 64. The sweep threads write positions of
+// neighboring chunks, so the words are only touched atomically
+static uint64_t loadRange(const uint64_t* words, size_t row, int start, int n) {
+	size_t w = row + start / 64;
+	int shift = start % 64;
+	uint64_t bits = __atomic_load_n(&words[w], __ATOMIC_RELAXED) >> shift;
+	if(shift > 0 && shift + n > 64)
+		bits |= __atomic_load_n(&words[w + 1], __ATOMIC_RELAXED) << (64 - shift);
+	return n < 64 ? bits & (((uint64_t)1 << n) - 1) : bits;
+}
+
+static void setRange(uint64_t* words, size_t row, int start, uint64_t bits) {
+	size_t w = row + start / 64;
+	int shift = start % 64;
+	uint64_t masks[2] = {bits << shift, shift > 0 ? bits >> (64 - shift) : 0};
+	for(int k = 0; k < 2; k++)
+		if(masks[k] && (__atomic_load_n(&words[w + k], __ATOMIC_RELAXED) & masks[k]) != masks[k])
+			__atomic_fetch_or(&words[w + k], masks[k], __ATOMIC_RELAXED);
+}
+
+static void clearRange(uint64_t* words, size_t row, int start, uint64_t bits) {
+	size_t w = row + start / 64;
+	int shift = start % 64;
+	uint64_t masks[2] = {bits << shift, shift > 0 ? bits >> (64 - shift) : 0};
+	for(int k = 0; k < 2; k++)
+		if(masks[k] && (__atomic_load_n(&words[w + k], __ATOMIC_RELAXED) & masks[k]))
+			__atomic_fetch_and(&words[w + k], ~masks[k], __ATOMIC_RELAXED);
+}
+
+void worklistWrite(struct sand_world* world, int x, int y) {
+	struct worklist* list = world->worklist;
+	// The positions (x-4..x, y-4..y), at bits x..x+4 of rows y..y+4. Fresh positions count as live, see
+	// positionLive, they're moved over when their chunk is next checked
+	for(int j = y; j < y + 5; j++)
+		setRange(list->fresh, (size_t)j*list->words, x, 0x1f);
+}
+
+void worklistEverything(struct sand_world* world) {
+	struct worklist* list = world->worklist;
+	size_t size = sizeof(uint64_t)*list->words*(world->height + 9);
+	memset(list->live, 0xff, size);
+	memset(list->pending, 0xff, size);
+	memset(list->fresh, 0, size);
+}
+
+static void retireTask(void* context, int task, int worker) {
+	struct sand_world* world = (struct sand_world*)context;
+	struct worklist* list = world->worklist;
+	int cx = world->awake[task] % world->chunks_x, cy = world->awake[task] / world->chunks_x;
+	int left, right, top, bottom;
+	chunkPositions(world, cx, cy, &left, &right, &top, &bottom);
+	if(left > right)
+		return;
+	int n = right - left + 1;
+	int possible[MAX_RULES];
+	int n_possible = -1; // Found once there's something to check
+	for(int y = top; y <= bottom; y++) {
+		size_t row = (size_t)(y + 4)*list->words;
+		uint64_t fresh = loadRange(list->fresh, row, left + 4, n);
+		uint64_t check = loadRange(list->pending, row, left + 4, n) & loadRange(list->live, row, left + 4, n) & ~fresh;
+		if(check) {
+			if(n_possible == -1)
+				n_possible = possibleRules(world, cx, cy, possible);
+			// The chunk's rules narrowed down to the elements around this row. A rule that fits passes the
+			// dispatch too, so which rules it would offer doesn't matter
+			struct presence around = presenceOf(world, left, y, right + 4, y + 4);
+			uint64_t unfit = check;
+			for(int p = 0; p < n_possible && unfit; p++)
+				if(presenceCovers(around, world->rules[possible[p]].needs))
+					unfit &= ~fitsRow(world, world->rules + possible[p], left, y, n, unfit);
+			clearRange(list->live, row, left + 4, unfit);
+		}
+		// Checked now, or to be checked once they've been quiet until the next time
+		clearRange(list->pending, row, left + 4, check);
+		setRange(list->live, row, left + 4, fresh);
+		setRange(list->pending, row, left + 4, fresh);
+		clearRange(list->fresh, row, left + 4, fresh);
+	}
+}
+
+void retireSettled(struct sand_world* world) {
+	if(world->iteration % world->sleep_after == 0)
+		poolRun(world->pool, world->n_awake, retireTask, world);
+}
+
+void sandSetWorklist(struct sand_world* world, bool enabled) {
+	if(!enabled) {
+		destroyWorklist(world);
+		return;
+	}
+	if(world->worklist != NULL)
+		return;
+	struct worklist* list = (struct worklist*)calloc(1, sizeof(struct worklist));
+	// Positions run from -4 to the width and height plus 4, see chunkPositions
+	list->words = (world->width + 9 + 63) / 64;
+	list->live = (uint64_t*)malloc(sizeof(uint64_t)*list->words*(world->height + 9));
+	list->pending = (uint64_t*)malloc(sizeof(uint64_t)*list->words*(world->height + 9));
+	list->fresh = (uint64_t*)malloc(sizeof(uint64_t)*list->words*(world->height + 9));
+	world->worklist = list;
+	worklistEverything(world);
+}
+
+void destroyWorklist(struct sand_world* world) {
+	struct worklist* list = world->worklist;
+	if(list == NULL)
+		return;
+	free(list->live);
+	free(list->pending);
+	free(list->fresh);
+	free(list);
+	world->worklist = NULL;
+}
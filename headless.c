@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "engine/sand.h"
+
+#ifdef SAND_COMPILED
+// The rules compiled by 'make aot', see sandWriteCompiled
+extern const struct sand_compiled sand_compiled_rules;
+#endif
+
+// Batch runner, runs a ruleset for a fixed number of steps without a window and reports throughput
+
+struct fill {
+	char key;
+	float percent;
+};
+
+// splitmix64, so a seed scatters the same starting world on every platform
+static uint64_t fill_state;
+static double fillRandom() {
+	uint64_t z = (fill_state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return ((z ^ (z >> 31)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+#define KEYFRAME_STEPS 256 // Between the keyframes of a recording
+
+// Plays every frame of a recording in order, reporting throughput and the last frame's checksum
+static int play(const char* path) {
+	struct sand_replay* replay = sandOpenReplay(path);
+	if(replay == NULL)
+		return 1;
+	int width = sandReplayWidth(replay), height = sandReplayHeight(replay), frames = sandReplayFrames(replay);
+	printf("Playing %d frames of %dx%d\n", frames, width, height);
+	double start = now();
+	for(int f = 1; f < frames; f++)
+		sandSeekReplay(replay, f);
+	double elapsed = now() - start;
+	printf("%d frames in %.3fs\n", frames - 1, elapsed);
+	printf("%.1f frames/s, %.3f Mcells/s\n", (frames - 1) / elapsed, (double)width * height * (frames - 1) / elapsed / 1e6);
+
+	uint64_t checksum = 14695981039346656037ull;
+	for(int j = 0; j < height; j++)
+		for(int i = 0; i < width; i++)
+			checksum = (checksum ^ sandReplayGet(replay, i, j)) * 1099511628211ull;
+	printf("checksum %016llx\n", (unsigned long long)checksum);
+	sandCloseReplay(replay);
+	return 0;
+}
+
+static void usage(const char* name) {
+	printf("usage: %s [-r rules_dir] [-n steps] [-w width] [-h height] [-t threads] [-s seed] [-i iterations] [-p stepping]\n"
+		"       [-m dispatch|network] [-a] [-c cache] [-g generated.c] [-l snapshot] [-o snapshot [-k every]] [-R recording]\n"
+		"       [-f key:percent]...\n"
+		"       %s -P recording\n", name, name);
+	printf("  -t defaults to the number of cores, -s to the current time. The same seed and arguments replay\n");
+	printf("     the same run bit for bit whatever the number of threads, compare the printed checksums.\n");
+	printf("  -m picks how rules are matched, anchor dispatch (the default) or one network of every rule.\n");
+	printf("  -a only sweeps the positions where something might happen, see sandSetWorklist. A different\n");
+	printf("     run than without it, with the same odds.\n");
+	printf("  -c loads the rules through a cache file, made on the first run and remade when a ruleset changes.\n");
+	printf("  -g writes the rules out as C for 'make aot' and exits.\n");
+	printf("  -l starts from a snapshot instead of scattering elements, its size overrides -w and -h. With the\n");
+	printf("     same rules it carries on the saved run, seed included.\n");
+	printf("  -o saves a snapshot after the run, and with -k every 'every' steps in the background during it.\n");
+	printf("  -R records the run, -P plays a recording back as fast as it can without running any rules. The last\n");
+	printf("     frame's checksum is the recorded run's.\n");
+	printf("  -f scatters the element bound to 'key' over 'percent' of the world, can be repeated.\n");
+	printf("     Without -f every bound element is scattered evenly over 40%% of the world.\n");
+}
+
+int main(int argc, char* argv[]) {
+	const char* rules_dir = "./rules";
+	const char* cache = NULL;
+	int steps = 1000, width = 80, height = 80;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int iterations = 4, stepping = 2;
+	bool network = false;
+	bool worklist = false;
+	const char* generate = NULL;
+	const char* load = NULL;
+	const char* save = NULL;
+	int save_every = 0;
+	const char* record = NULL;
+	uint64_t seed = time(NULL);
+	struct fill fills[64];
+	int n_fills = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(i + 1 < argc && strcmp(argv[i], "-r") == 0)
+			rules_dir = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-n") == 0)
+			steps = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-w") == 0)
+			width = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-h") == 0)
+			height = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-t") == 0)
+			threads = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-s") == 0)
+			seed = strtoull(argv[++i], NULL, 10);
+		else if(i + 1 < argc && strcmp(argv[i], "-i") == 0)
+			iterations = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-p") == 0)
+			stepping = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-m") == 0 && (strcmp(argv[i+1], "dispatch") == 0 || strcmp(argv[i+1], "network") == 0))
+			network = strcmp(argv[++i], "network") == 0;
+		else if(strcmp(argv[i], "-a") == 0)
+			worklist = true;
+		else if(i + 1 < argc && strcmp(argv[i], "-c") == 0)
+			cache = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-g") == 0)
+			generate = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-l") == 0)
+			load = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-o") == 0)
+			save = argv[++i];
+		else if(i + 1 < argc && strcmp(argv[i], "-k") == 0)
+			save_every = atoi(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-R") == 0)
+			record = argv[++i];
+		else if(argc == 3 && strcmp(argv[i], "-P") == 0)
+			return play(argv[++i]);
+		else if(i + 1 < argc && strcmp(argv[i], "-f") == 0 && n_fills < 64) {
+			char* arg = argv[++i];
+			if(strlen(arg) < 3 || arg[1] != ':') {
+				usage(argv[0]);
+				return 1;
+			}
+			fills[n_fills].key = arg[0];
+			fills[n_fills].percent = atof(arg + 2);
+			n_fills++;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(width <= 0 || height <= 0 || steps < 0 || save_every < 0 || (save_every > 0 && save == NULL)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(load != NULL && !sandSnapshotSize(load, &width, &height)) {
+		printf("\033[0;31m\"%s\" isn't a snapshot\033[0m\n", load);
+		return 1;
+	}
+
+	fill_state = seed;
+	struct sand_world* world = sandCreateWorld(width, height);
+	sandSeed(world, seed);
+	sandSetThreads(world, threads);
+	sandSetNetwork(world, network);
+	sandSetWorklist(world, worklist);
+	if(!sandSetSweep(world, iterations, stepping)) {
+		sandDestroyWorld(world);
+		return 1;
+	}
+	if(sandLoadRulesCached(world, rules_dir, cache) == 0) {
+		printf("No rules could be loaded from \"%s\"\n", rules_dir);
+		sandDestroyWorld(world);
+		return 1;
+	}
+	if(generate != NULL) {
+		bool written = sandWriteCompiled(world, generate);
+		sandDestroyWorld(world);
+		return written ? 0 : 1;
+	}
+#ifdef SAND_COMPILED
+	if(sandUseCompiled(world, &sand_compiled_rules))
+		printf("Running the compiled rules\n");
+#endif
+
+	if(load != NULL) {
+		if(!sandRestore(world, load)) {
+			sandDestroyWorld(world);
+			return 1;
+		}
+		n_fills = 0; // -f has nothing to do
+	} else if(n_fills == 0) {
+		// Every bound element gets an even share
+		for(int k = 0; k < 128 && n_fills < 64; k++)
+			if(toupper(k) == k && sandBind(world, k) != 0 && sandBind(world, k) != SAND_AIR) {
+				fills[n_fills].key = k;
+				n_fills++;
+			}
+		for(int f = 0; f < n_fills; f++)
+			fills[f].percent = 40.f / n_fills;
+	}
+	for(int f = 0; f < n_fills; f++) {
+		uint32_t color = sandBind(world, fills[f].key);
+		if(color == 0) {
+			printf("Nothing is bound to '%c'\n", fills[f].key);
+			continue;
+		}
+		for(int i = 0; i < width; i++)
+			for(int j = 0; j < height; j++)
+				if(fillRandom()*100 < fills[f].percent)
+					sandPut(world, color, i, j);
+	}
+
+	printf("Running %d rules on %dx%d for %d steps, %d threads, seed %llu\n", sandRuleCount(world), width, height, steps,
+		threads < 1 ? 1 : threads, (unsigned long long)seed);
+	if(record != NULL && !sandRecord(world, record, KEYFRAME_STEPS)) {
+		sandDestroyWorld(world);
+		return 1;
+	}
+	sandResetProfile(world); // The fills aren't part of the run
+	double start = now();
+	if(save_every > 0)
+		for(int done = 0; done < steps; done += save_every) {
+			sandCheckpoint(world, save);
+			sandStep(world, steps - done < save_every ? steps - done : save_every);
+		}
+	else
+		sandStep(world, steps);
+	double elapsed = now() - start;
+
+	double cells = (double)width * height * steps;
+	printf("%d steps in %.3fs\n", steps, elapsed);
+	printf("%.1f steps/s, %.3f Mcells/s\n", steps / elapsed, cells / elapsed / 1e6);
+
+	// FNV-1a over the final colors, for checking that runs replay
+	uint64_t checksum = 14695981039346656037ull;
+	for(int j = 0; j < height; j++)
+		for(int i = 0; i < width; i++)
+			checksum = (checksum ^ sandGet(world, i, j)) * 1099511628211ull;
+	printf("checksum %016llx\n", (unsigned long long)checksum);
+	// Only built with SAND_PROFILE
+	sandPrintProfile(world);
+
+	bool saved = sandStopRecording(world);
+	if(save != NULL) {
+		sandFinishCheckpoint(world);
+		saved = sandCheckpoint(world, save) && sandFinishCheckpoint(world) && saved;
+	}
+	sandDestroyWorld(world);
+	return saved ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#ifdef _WIN32
+#include <SDL.h>
+#else
+#include <SDL2/SDL.h>
+#endif
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "engine/sand.h"
+#undef main
+
+// Player for recordings made with -R, see sandRecord. Nothing is simulated, frames are only decoded
+
+#define MAX_SPEED 4096 // Frames per displayed frame
+
+static void usage(const char* name) {
+	printf("usage: %s [-z window_scale] recording\n", name);
+	printf("  Space pauses, Up and Down double and halve the speed, Left and Right skip back and ahead a\n");
+	printf("  twentieth of the recording, Home and End go to the start and the end, '.' steps while paused.\n");
+}
+
+int main(int argc, char* argv[]) {
+	int window_scale = 0;
+	const char* path = NULL;
+	for(int i = 1; i < argc; i++) {
+		if(i + 1 < argc && strcmp(argv[i], "-z") == 0)
+			window_scale = atoi(argv[++i]);
+		else if(path == NULL && argv[i][0] != '-')
+			path = argv[i];
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(path == NULL || window_scale < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	struct sand_replay* replay = sandOpenReplay(path);
+	if(replay == NULL)
+		return 1;
+	int width = sandReplayWidth(replay), height = sandReplayHeight(replay), frames = sandReplayFrames(replay);
+	if(window_scale == 0)
+		window_scale = width >= 640 ? 1 : 640 / width;
+
+	SDL_Init(SDL_INIT_VIDEO);
+	SDL_Window* w;
+	if((w = SDL_CreateWindow("Sand replay", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width*window_scale, height*window_scale, SDL_WINDOW_OPENGL))==NULL)
+		return 1;
+	SDL_Renderer *renderer = SDL_CreateRenderer(w, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	SDL_Surface* surf = SDL_CreateRGBSurface(0, width, height, 32, 0, 0, 0, 0);
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, 0);
+	SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_BGRA32, SDL_TEXTUREACCESS_STREAMING, width, height);
+
+	int speed = 1;
+	bool paused = false;
+	int shown = -1;
+	SDL_Event ev;
+	bool running = true;
+	while(running) {
+		int frame = sandReplayFrame(replay);
+		int skip = frames / 20 > 1 ? frames / 20 : 1;
+		while(SDL_PollEvent(&ev)) {
+			if(ev.type==SDL_QUIT)
+				running = false;
+			if(ev.type!=SDL_KEYDOWN)
+				continue;
+			switch(ev.key.keysym.scancode) {
+			case SDL_SCANCODE_SPACE:
+				paused = !paused;
+				break;
+			case SDL_SCANCODE_UP:
+				speed = speed < MAX_SPEED ? speed*2 : MAX_SPEED;
+				break;
+			case SDL_SCANCODE_DOWN:
+				speed = speed > 1 ? speed/2 : 1;
+				break;
+			case SDL_SCANCODE_LEFT:
+				frame = sandSeekReplay(replay, frame - skip);
+				break;
+			case SDL_SCANCODE_RIGHT:
+				frame = sandSeekReplay(replay, frame + skip);
+				break;
+			case SDL_SCANCODE_HOME:
+				frame = sandSeekReplay(replay, 0);
+				break;
+			case SDL_SCANCODE_END:
+				frame = sandSeekReplay(replay, frames - 1);
+				break;
+			case SDL_SCANCODE_PERIOD:
+				if(paused)
+					frame = sandSeekReplay(replay, frame + 1);
+				break;
+			default:
+				break;
+			}
+		}
+		if(!paused)
+			frame = sandSeekReplay(replay, frame + speed);
+
+		if(frame != shown) {
+			char title[128];
+			snprintf(title, sizeof(title), "Sand replay - frame %d of %d, %dx", frame, frames - 1, speed);
+			SDL_SetWindowTitle(w, title);
+			sandRenderReplay(replay, (uint32_t*)surf->pixels, surf->pitch);
+			SDL_UpdateTexture(texture, NULL, surf->pixels, surf->pitch);
+			shown = frame;
+		}
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, texture, NULL, NULL);
+		SDL_RenderPresent(renderer);
+	}
+
+	sandCloseReplay(replay);
+	SDL_DestroyWindow(w);
+	return 0;
+}